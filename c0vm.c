@@ -10,6 +10,20 @@
 #include "lib/c0vm.h"
 #include "lib/c0vm_c0ffi.h"
 #include "lib/c0vm_abort.h"
+#include "lib/c0vm_heap.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_exec.h"
+#include "lib/c0vm_allocprof.h"
+#include "lib/c0vm_profile.h"
+#include "lib/c0vm_flame.h"
+#include "lib/c0vm_perf.h"
+#include "lib/c0vm_memo.h"
+#include "lib/c0vm_probes.h"
+#include "lib/c0vm_recorder.h"
+
+/* Native arguments that fit in INVOKENATIVE's local array */
+#define C0_NATIVE_ARGS 8
 
 /* call stack frames */
 typedef struct frame_info frame;
@@ -18,29 +32,120 @@ struct frame_info {
   ubyte *P;        /* Function body */
   c0_value *V;     /* The local variables */
   size_t pc;       /* Program counter */
+  uint16_t fn;     /* Index of the function in function_pool */
+  uint64_t memo;   /* c0_memo_lookup's ticket for the call made, or 0 */
 };
 
+/* What a call holds on the heap while it runs, counted against its
+ * limit; the operand stack is not counted. Frames are charged to the
+ * heap FRAME_CHUNK bytes at a time, so most calls and returns only
+ * move bytes in and out of exec->frame_credit. */
+#define FRAME_BYTES(num_vars) \
+  (sizeof(frame) + (size_t)(num_vars) * sizeof(c0_value))
+#define FRAME_CHUNK 4096
+
+/* Branches and calls spend fuel; a run that spends the last of it
+ * stops with the branch taken, to go on at its target */
+#define JUMP(offset) do {                                      \
+    pc += (offset);                                            \
+    if ((offset) < 0 && --fuel == 0) goto out_of_fuel;         \
+  } while (0)
+
 int execute(struct bc0_file *bc0) {
   REQUIRES(bc0 != NULL);
+  struct c0_exec exec = { bc0, &c0_recorder, c0_natives_resolve(bc0), NULL,
+                          NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 };
+  int result = val2int(c0_execute(&exec, 0, NULL));
+  free(exec.natives);
+  return result;
+}
+
+c0_value c0_execute(struct c0_exec *exec, uint16_t fn0, c0_value *args) {
+  c0_exec_start(exec, fn0, args);
+  exec->fuel = C0_FUEL_UNLIMITED;
+  c0_value result;
+  enum c0_exec_state state = c0_exec_run(exec, &result);
+  ASSERT(state == C0_EXEC_DONE);
+  (void) state;
+  return result;
+}
+
+void c0_exec_start(struct c0_exec *exec, uint16_t fn0, c0_value *args) {
+  REQUIRES(exec != NULL && exec->bc0 != NULL && exec->natives != NULL);
+  REQUIRES(fn0 < exec->bc0->function_count);
+  struct function_info *entry = &exec->bc0->function_pool[fn0];
+  if (entry->code == NULL) c0_load_function(exec->bc0, fn0);
+
+  /* Local variables, the first num_args of them the arguments */
+  exec->V = xcalloc((size_t) entry->num_vars, sizeof *exec->V);
+  for (size_t i = 0; i < entry->num_args; i++) exec->V[i] = args[i];
+  exec->S = c0v_stack_new();
+  exec->call_stack = stack_new();
+  exec->pc = 0;
+  exec->fn = fn0;
+  exec->depth = 0;
+  exec->prof_prev = C0_PROFILE_START;
+  exec->frame_credit = 0;
+  if (c0_profile_enabled) c0_profile.fn_calls[fn0]++;
+  if (c0_perf_enabled) c0_perf_call(fn0);
+  if (c0_flame_enabled) c0_flame_enter(fn0);
+  C0VM_PROBE2(function__entry, fn0, 0);
+}
 
-  /* Variables */
-  c0v_stack_t S = c0v_stack_new(); 							/* Operand stack of C0 values */
-  ubyte *P = bc0->function_pool[0].code;	     	/* Array of bytes that make up the current function */
-  size_t pc = 0;							     							/* Current location within the current byte array P */
-	/* Local variables (you won't need this till Task 2) */
-  c0_value *V = xcalloc((size_t) bc0->function_pool[0].num_vars, sizeof *V);   
-  (void) V;      // silences compilation errors about V being currently unused
+enum c0_exec_state c0_exec_run(struct c0_exec *exec, c0_value *result) {
+  REQUIRES(exec != NULL && exec->call_stack != NULL && exec->fuel > 0);
+  struct bc0_file *bc0 = exec->bc0;
+
+  /* Variables, where the last run stopped */
+  c0v_stack_t S = exec->S;										/* Operand stack of C0 values */
+  uint16_t cur_fn = exec->fn;                 /* Index of the current function */
+  ubyte *P = bc0->function_pool[cur_fn].code;	/* Array of bytes that make up the current function */
+  size_t pc = exec->pc;												/* Current location within the current byte array P */
+  size_t depth = exec->depth;                 /* Frames on the call stack */
+  c0_value *V = exec->V;                      /* Local variables */
+  uint64_t fuel = exec->fuel;
+  size_t credit = exec->frame_credit;
 
   /* The call stack, a generic stack that should contain pointers to frames */
-  /* You won't need this until you implement functions. */
-  gstack_t callStack = stack_new();
+  gstack_t callStack = exec->call_stack;
+
+  /* S and V are kept up to date in exec for c0_exec_unwind */
+  native_fn **natives = exec->natives;
+  struct c0_recorder *rec = exec->recorder;
+
+  /* Profiling state, see c0vm_profile.h */
+  bool profiling = c0_profile_enabled;
+  unsigned prof_prev = exec->prof_prev;      /* both carry on from the last run */
+  uint64_t icount = c0_profile.mark;
+
+  /* Call-graph timing, see c0vm_flame.h */
+  bool flaming = c0_flame_enabled;
+
+  /* Hardware counters per function, see c0vm_perf.h */
+  bool perf_counting = c0_perf_enabled;
+
+  /* Results of pure functions, see c0vm_memo.h */
+  bool memoizing = c0_memo_enabled;
+
+  /* A run that blocked stopped at an INVOKENATIVE it had profiled
+   * already; one out of fuel stopped after a branch or call */
+  if (profiling && prof_prev == INVOKENATIVE) goto profiled;
 
   while (true) {
 
+    if (profiling) {
+      c0_profile_op(&prof_prev, P[pc]);
+      icount++;
+    }
+profiled:
+
+    c0_record(rec, cur_fn, pc, P[pc], depth);
+
 #ifdef DEBUG
     /* You can add extra debugging information here */
-    fprintf(stderr, "Opcode %x -- Stack size: %zu -- PC: %zu\n",
-            P[pc], c0v_stack_size(S), pc);
+    if (c0_trace_enabled)
+      fprintf(stderr, "Opcode %x -- Stack size: %zu -- PC: %zu\n",
+              P[pc], c0v_stack_size(S), pc);
 #endif
 
     switch (P[pc]) {
@@ -79,6 +184,10 @@ int execute(struct bc0_file *bc0) {
     case RETURN: {
 			// Pop the last value from the stack
 			c0_value retval = c0v_pop(S);
+			if (profiling) c0_profile_switch(cur_fn, icount);
+			if (flaming) c0_flame_exit();
+			if (perf_counting) c0_perf_switch(cur_fn);
+			C0VM_PROBE2(function__return, cur_fn, depth);
 
       // Free everything before returning from the execute function!
 			c0v_stack_free(S);
@@ -87,16 +196,33 @@ int execute(struct bc0_file *bc0) {
 			// Resume the last frame if exist
 			if (!stack_empty(callStack)) {
 				frame *prev_frame = (frame *) pop(callStack);
+				if (memoizing && prev_frame->memo != 0)
+					c0_memo_store(cur_fn, prev_frame->memo, retval);
 				S = prev_frame->S;
 				P = prev_frame->P;
 				pc = prev_frame->pc + 3;
 				V = prev_frame->V;
+				credit += FRAME_BYTES(bc0->function_pool[cur_fn].num_vars);
+				if (credit > 2 * FRAME_CHUNK) {
+					c0_heap_uncharge(credit - FRAME_CHUNK);
+					credit = FRAME_CHUNK;
+				}
+				cur_fn = prev_frame->fn;
+				depth--;
 				free(prev_frame);
 				c0v_push(S, retval);
+				exec->S = S;
+				exec->V = V;
 				break;
 			}
+			c0_heap_uncharge(credit);
+			exec->frame_credit = 0;
 			stack_free(callStack, free);
-			return val2int(retval);
+			exec->S = NULL;
+			exec->V = NULL;
+			exec->call_stack = NULL;
+			*result = retval;
+			return C0_EXEC_DONE;
     }
 
     /* Arithmetic and Logical operations */
@@ -290,7 +416,7 @@ int execute(struct bc0_file *bc0) {
 			c0_value v2 = c0v_pop(S);
 			c0_value v1 = c0v_pop(S);
 
-			if (val_equal(v1, v2)) pc += offset;
+			if (val_equal(v1, v2)) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -304,7 +430,7 @@ int execute(struct bc0_file *bc0) {
 			c0_value v2 = c0v_pop(S);
 			c0_value v1 = c0v_pop(S);
 
-			if (!val_equal(v1, v2)) pc += offset;
+			if (!val_equal(v1, v2)) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -318,7 +444,7 @@ int execute(struct bc0_file *bc0) {
 			int32_t y = val2int(c0v_pop(S));
 			int32_t x = val2int(c0v_pop(S));
 
-			if (x < y) pc += offset;
+			if (x < y) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -332,7 +458,7 @@ int execute(struct bc0_file *bc0) {
 			int32_t y = val2int(c0v_pop(S));
 			int32_t x = val2int(c0v_pop(S));
 
-			if (x >= y) pc += offset;
+			if (x >= y) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -346,7 +472,7 @@ int execute(struct bc0_file *bc0) {
 			int32_t y = val2int(c0v_pop(S));
 			int32_t x = val2int(c0v_pop(S));
 
-			if (x > y) pc += offset;
+			if (x > y) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -360,7 +486,7 @@ int execute(struct bc0_file *bc0) {
 			int32_t y = val2int(c0v_pop(S));
 			int32_t x = val2int(c0v_pop(S));
 
-			if (x <= y) pc += offset;
+			if (x <= y) JUMP(offset);
 			else pc += 3;
 			break;
 		}
@@ -371,7 +497,7 @@ int execute(struct bc0_file *bc0) {
 			uint16_t o2 = P[pc + 2];
 			int16_t offset = (int16_t) (o1 << 8 | o2);
 
-			pc += offset;
+			JUMP(offset);
 			break;
 		}
 
@@ -383,6 +509,42 @@ int execute(struct bc0_file *bc0) {
 			uint16_t o2 = P[pc + 2];
 			uint16_t fn_idx = (o1 << 8) | o2;
 			struct function_info fn = bc0->function_pool[fn_idx];
+			if (fn.code == NULL) fn.code = c0_load_function(bc0, fn_idx);
+
+			// Charged before anything is allocated, as the charge may
+			// longjmp out with the arguments still on S
+			size_t frame_bytes = FRAME_BYTES(fn.num_vars);
+			if (credit < frame_bytes) {
+				c0_heap_charge(FRAME_CHUNK + frame_bytes);
+				credit += FRAME_CHUNK + frame_bytes;
+			}
+			credit -= frame_bytes;
+
+			// The new local variables, the first num_args of them the arguments
+			c0_value *locals = xcalloc(fn.num_vars, sizeof *locals);
+			for (int i = fn.num_args - 1; i >= 0; i--) {
+				locals[i] = c0v_pop(S);
+			}
+
+			uint64_t memo = 0;
+			if (memoizing) {
+				c0_value known;
+				if (c0_memo_lookup(fn_idx, locals, &known, &memo)) {
+					free(locals);
+					credit += frame_bytes;
+					c0v_push(S, known);
+					pc += 3;
+					break;
+				}
+			}
+			if (profiling) {
+				c0_profile_switch(cur_fn, icount);
+				c0_profile.fn_calls[fn_idx]++;
+			}
+			if (perf_counting) {
+				c0_perf_switch(cur_fn);
+				c0_perf_call(fn_idx);
+			}
 
 			// Create a new frame of current execution environment
 			frame *f = xmalloc(sizeof(frame));
@@ -390,18 +552,22 @@ int execute(struct bc0_file *bc0) {
 			f->P = P;
 			f->pc = pc;
 			f->V = V;
+			f->fn = cur_fn;
+			f->memo = memo;
 			push(callStack, f);
+			depth++;
 
 			// Set pc to the beginning of the function
-			V = xcalloc(fn.num_vars, sizeof *V);
-
-			for (int i = fn.num_args - 1; i >= 0; i--) {
-				V[i] = c0v_pop(S);
-			}
-
+			V = locals;
 			S = c0v_stack_new();
 			P = fn.code;
 			pc = 0;
+			cur_fn = fn_idx;
+			exec->S = S;
+			exec->V = V;
+			if (flaming) c0_flame_enter(fn_idx);
+			C0VM_PROBE2(function__entry, fn_idx, depth);
+			if (--fuel == 0) goto out_of_fuel;
 			break;
 		}
 
@@ -410,18 +576,42 @@ int execute(struct bc0_file *bc0) {
 			uint16_t o2 = P[pc + 2];
 			uint16_t fn_idx = (o1 << 8) | o2;
 			struct native_info native = bc0->native_pool[fn_idx];
-
-			c0_value *args = xcalloc(native.num_args, sizeof *args);
-			native_fn *fn = native_function_table[native.function_table_index];
-
-			for (int i = native.num_args - 1; i >= 0; i--) {
-				args[i] = c0v_pop(S);
+			if (exec->would_block != NULL
+			    && (*exec->would_block)(native.function_table_index))
+				goto blocked;
+			if (profiling) c0_profile.native_calls[fn_idx]++;
+
+			native_fn *fn = natives[fn_idx];
+
+			/* Arguments go in a local array, popped without a loop for the
+			 * usual 0 to 3; only natives with more than C0_NATIVE_ARGS
+			 * arguments need the heap */
+			c0_value local[C0_NATIVE_ARGS];
+			c0_value *args = local;
+			switch (native.num_args) {
+			case 3: args[2] = c0v_pop(S); /* fall through */
+			case 2: args[1] = c0v_pop(S); /* fall through */
+			case 1: args[0] = c0v_pop(S); /* fall through */
+			case 0: break;
+			default:
+				if (native.num_args > C0_NATIVE_ARGS)
+					args = xcalloc(native.num_args, sizeof *args);
+				for (int i = native.num_args - 1; i >= 0; i--) {
+					args[i] = c0v_pop(S);
+				}
 			}
 
+			if (flaming) c0_flame_enter_native(fn_idx);
+			C0VM_PROBE2(native__entry, fn_idx, native.function_table_index);
 			c0_value v = (*fn) (args);
+			C0VM_PROBE2(native__return, fn_idx, native.function_table_index);
+			if (flaming) c0_flame_exit();
+			if (args != local) free(args);
+			size_t bytes = c0_heap_native_result(native.function_table_index, v);
+			if (bytes > 0 && c0_allocprof_enabled)
+				c0_allocprof_record(C0_ALLOC_NATIVE, cur_fn, pc, bytes);
 			c0v_push(S, v);
 			pc += 3;
-			free(args);
 			break;
 		}
 
@@ -431,8 +621,11 @@ int execute(struct bc0_file *bc0) {
 
     case NEW: {
 			ubyte s = P[pc + 1];
+			if (c0_allocprof_enabled)
+				c0_allocprof_record(C0_ALLOC_NEW, cur_fn, pc, s);
+			C0VM_PROBE2(alloc, C0_ALLOC_NEW, s);
 			pc += 2;
-			void *p = xmalloc(s);
+			void *p = c0_object_alloc(s);
 			c0v_push(S, ptr2val(p));
 			break;
 		}
@@ -486,7 +679,7 @@ int execute(struct bc0_file *bc0) {
 
     case CMLOAD: {
 			// Pop an address from the stack
-			uint32_t *a = val2ptr(c0v_pop(S));
+			ubyte *a = val2ptr(c0v_pop(S));
 			if (a == NULL) c0_memory_error("NULL deference");
 			uint32_t x = (uint32_t) (*a);
 			c0v_push(S, int2val(x));
@@ -497,7 +690,7 @@ int execute(struct bc0_file *bc0) {
     case CMSTORE: {
 			// Pop an int from the stack
 			uint32_t x = val2int(c0v_pop(S));	
-			uint32_t *a = val2ptr(c0v_pop(S));
+			ubyte *a = val2ptr(c0v_pop(S));
 			if (a == NULL) c0_memory_error("NULL deference");
 			*a = x & 0x7f;
 			pc++;
@@ -521,10 +714,14 @@ int execute(struct bc0_file *bc0) {
 			if (n < 0) c0_memory_error("array size cannot be negative");
 			size_t s = P[pc + 1];
 			// Alloc the array struct
-			c0_array *arr = (c0_array *) xmalloc(sizeof *arr);
+			c0_array *arr = (c0_array *) c0_object_alloc(sizeof *arr);
 			arr->count = n;
 			arr->elt_size = s;
-			arr->elems = xcalloc(n, s);
+			arr->elems = c0_array_alloc(n, s);
+			if (c0_allocprof_enabled)
+				c0_allocprof_record(C0_ALLOC_NEWARRAY, cur_fn, pc,
+				                    sizeof *arr + (size_t)n * s);
+			C0VM_PROBE2(alloc, C0_ALLOC_NEWARRAY, sizeof *arr + (size_t)n * s);
 			c0v_push(S, ptr2val(arr));
 			pc += 2;
 			break;
@@ -566,12 +763,103 @@ int execute(struct bc0_file *bc0) {
 
     case INVOKEDYNAMIC:
 
-    default:
-      fprintf(stderr, "invalid opcode: 0x%02x\n", P[pc]);
-      abort();
+    default: {
+      // A runtime error rather than abort(), so a host only loses the call
+      static __thread char message[32];
+      snprintf(message, sizeof message, "unsupported opcode 0x%02x", P[pc]);
+      c0_value_error(message);
+      abort();  // c0_value_error does not return
+    }
     }
   }
 
   /* cannot get here from infinite loop */
   assert(false);
+
+  enum c0_exec_state state;
+out_of_fuel:
+  state = C0_EXEC_OUT_OF_FUEL;
+  goto stop;
+blocked:
+  state = C0_EXEC_BLOCKED;
+stop:
+  if (profiling) c0_profile_switch(cur_fn, icount);
+  exec->pc = pc;
+  exec->fn = cur_fn;
+  exec->depth = depth;
+  exec->fuel = fuel;
+  exec->prof_prev = prof_prev;
+  exec->frame_credit = credit;
+  return state;
+}
+
+void c0_exec_unwind(struct c0_exec *exec) {
+  REQUIRES(exec != NULL);
+  if (exec->call_stack == NULL) return;
+  c0v_stack_free(exec->S);
+  free(exec->V);
+  while (!stack_empty(exec->call_stack)) {
+    frame *f = (frame *) pop(exec->call_stack);
+    c0v_stack_free(f->S);
+    free(f->V);
+    free(f);
+  }
+  stack_free(exec->call_stack, free);
+  exec->S = NULL;
+  exec->V = NULL;
+  exec->call_stack = NULL;
+  exec->frame_credit = 0;
 }
+
+size_t c0_exec_frames(struct c0_exec *exec, struct c0_exec_frame **frames) {
+  REQUIRES(exec != NULL && exec->call_stack != NULL && frames != NULL);
+  size_t count = exec->depth + 1;
+  struct c0_exec_frame *all = xcalloc(count, sizeof *all);
+
+  /* The call stack only pops, so take the callers off and put them back */
+  frame **callers = xcalloc(count, sizeof *callers);
+  for (size_t i = exec->depth; i > 0; i--) {
+    callers[i - 1] = (frame *) pop(exec->call_stack);
+    all[i - 1].fn = callers[i - 1]->fn;
+    all[i - 1].pc = callers[i - 1]->pc;
+    all[i - 1].V = callers[i - 1]->V;
+    all[i - 1].S = callers[i - 1]->S;
+  }
+  for (size_t i = 0; i < exec->depth; i++) push(exec->call_stack, callers[i]);
+  free(callers);
+
+  all[exec->depth].fn = exec->fn;
+  all[exec->depth].pc = exec->pc;
+  all[exec->depth].V = exec->V;
+  all[exec->depth].S = exec->S;
+  *frames = all;
+  return count;
+}
+
+void c0_exec_restore(struct c0_exec *exec, struct c0_exec_frame *frames,
+                     size_t count) {
+  REQUIRES(exec != NULL && exec->bc0 != NULL && frames != NULL && count > 0);
+  struct bc0_file *bc0 = exec->bc0;
+  c0_load_all_functions(bc0);
+  exec->call_stack = stack_new();
+  for (size_t i = 0; i + 1 < count; i++) {
+    frame *f = xmalloc(sizeof(frame));
+    f->S = frames[i].S;
+    f->P = bc0->function_pool[frames[i].fn].code;
+    f->pc = frames[i].pc;
+    f->V = frames[i].V;
+    f->fn = frames[i].fn;
+    f->memo = 0;
+    push(exec->call_stack, f);
+    // The callee's frame, which its RETURN gives back
+    c0_heap_charge(FRAME_BYTES(bc0->function_pool[frames[i + 1].fn].num_vars));
+  }
+  exec->S = frames[count - 1].S;
+  exec->V = frames[count - 1].V;
+  exec->fn = frames[count - 1].fn;
+  exec->pc = frames[count - 1].pc;
+  exec->depth = count - 1;
+  exec->prof_prev = C0_PROFILE_START;
+  exec->frame_credit = 0;
+}
+
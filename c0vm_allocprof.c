@@ -0,0 +1,145 @@
+/* C0VM allocation profiler
+ * One open-addressing hash table of sites keyed by (kind, fn, pc).
+ * Recording is a hash probe and three increments, so it is cheap
+ * enough to leave switched on.
+ */
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_allocprof.h"
+
+#define HIST_BUCKETS 40   // bucket k holds sizes in [2^(k-1), 2^k)
+
+typedef struct site site;
+struct site {
+  uint64_t key;           // 0 means empty, see site_key
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t hist[HIST_BUCKETS];
+};
+
+bool c0_allocprof_enabled = false;
+
+static site *sites = NULL;
+static size_t capacity = 0;   // always a power of two
+static size_t used = 0;
+
+static const char *kind_names[C0_ALLOC_KINDS] = {
+  [C0_ALLOC_NEW] = "new",
+  [C0_ALLOC_NEWARRAY] = "newarray",
+  [C0_ALLOC_TAG] = "addtag",
+  [C0_ALLOC_NATIVE] = "native",
+};
+
+static uint64_t site_key(enum c0_alloc_kind kind, uint16_t fn, size_t pc) {
+  return (((uint64_t)kind << 48) | ((uint64_t)fn << 32) | (uint32_t)pc) + 1;
+}
+
+static size_t hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t) key;
+}
+
+static unsigned bucket(size_t bytes) {
+  unsigned k = 0;
+  while (bytes != 0 && k < HIST_BUCKETS - 1) {
+    bytes >>= 1;
+    k++;
+  }
+  return k;
+}
+
+static site *find(uint64_t key) {
+  size_t i = hash(key) & (capacity - 1);
+  while (sites[i].key != 0 && sites[i].key != key)
+    i = (i + 1) & (capacity - 1);
+  return &sites[i];
+}
+
+static void grow(void) {
+  site *old = sites;
+  size_t old_capacity = capacity;
+
+  capacity = capacity == 0 ? 256 : 2 * capacity;
+  sites = xcalloc(capacity, sizeof *sites);
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].key != 0) *find(old[i].key) = old[i];
+  }
+  free(old);
+}
+
+void c0_allocprof_record(enum c0_alloc_kind kind, uint16_t fn, size_t pc,
+                         size_t bytes) {
+  REQUIRES(kind < C0_ALLOC_KINDS);
+
+  if (2 * (used + 1) > capacity) grow();
+  uint64_t key = site_key(kind, fn, pc);
+  site *s = find(key);
+  if (s->key == 0) {
+    s->key = key;
+    used++;
+  }
+  s->count++;
+  s->bytes += bytes;
+  s->hist[bucket(bytes)]++;
+}
+
+static int by_bytes_desc(const void *a, const void *b) {
+  const site *x = a, *y = b;
+  if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+void c0_allocprof_report(FILE *out, struct c0_debug_info *dbg) {
+  site *sorted = xcalloc(used + 1, sizeof *sorted);
+  size_t n = 0;
+  uint64_t total_count = 0, total_bytes = 0;
+  for (size_t i = 0; i < capacity; i++) {
+    if (sites[i].key == 0) continue;
+    sorted[n++] = sites[i];
+    total_count += sites[i].count;
+    total_bytes += sites[i].bytes;
+  }
+  qsort(sorted, n, sizeof *sorted, by_bytes_desc);
+
+  fprintf(out, "# c0vm allocation profile\n");
+  fprintf(out, "# %" PRIu64 " allocations, %" PRIu64 " bytes, %zu sites\n",
+          total_count, total_bytes, n);
+  fprintf(out, "#%15s %12s %10s  %-8s  %-24s  %s\n",
+          "bytes", "count", "avg", "kind", "site", "sizes (<=bytes:count)");
+
+  for (size_t i = 0; i < n; i++) {
+    site *s = &sorted[i];
+    uint64_t key = s->key - 1;
+    unsigned kind = (unsigned)(key >> 48);
+    uint16_t fn = (uint16_t)(key >> 32);
+    uint32_t pc = (uint32_t)key;
+
+    char buf[32], where[96];
+    snprintf(where, sizeof where, "%s+%" PRIu32,
+             c0_function_name(dbg, fn, buf, sizeof buf), pc);
+    fprintf(out, "%16" PRIu64 " %12" PRIu64 " %10" PRIu64 "  %-8s  %-24s ",
+            s->bytes, s->count, s->bytes / s->count, kind_names[kind], where);
+    for (unsigned k = 0; k < HIST_BUCKETS; k++) {
+      if (s->hist[k] == 0) continue;
+      uint64_t limit = k == 0 ? 0 : ((uint64_t)1 << k) - 1;
+      fprintf(out, " %" PRIu64 ":%" PRIu64, limit, s->hist[k]);
+    }
+    fprintf(out, "\n");
+  }
+
+  free(sorted);
+}
+
+void c0_allocprof_free(void) {
+  free(sites);
+  sites = NULL;
+  capacity = 0;
+  used = 0;
+}
@@ -0,0 +1,434 @@
+/* C0VM batch runner
+ * Runs many C0 programs in one process instead of one c0vm process per
+ * program. The manifest has one job per line, a bc0 file followed by
+ * the arguments its main gets; blank lines and lines starting with #
+ * are skipped. Every distinct bc0 file is loaded once and shared by its
+ * jobs. Each job runs main in a fresh context (lib/c0vm_context.h),
+ * with its own heap and its print output captured, and is reported as
+ * one JSON line on stdout when it finishes.
+ *
+ * Jobs are dealt round-robin onto one queue per worker thread. A worker
+ * takes from the back of its own queue and, once that is empty, steals
+ * from the front of the others'. With --green=N it keeps N jobs going
+ * at once and gives each a turn of --fuel backward branches and calls
+ * (c0_vm_resume), so short jobs are not stuck behind long ones.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_output.h"
+
+struct program {
+  char *path;
+  struct bc0_file *bc0;       // NULL if it could not be loaded
+  bool uses_args;             // calls the args natives
+};
+
+struct job {
+  size_t line;                // in the manifest
+  size_t program;             // index into programs
+  int argc;                   // argv[0] is the bc0 file, as in c0vm
+  char **argv;
+};
+
+struct queue {
+  pthread_mutex_t lock;
+  size_t *jobs;
+  size_t head;                // thieves take from here
+  size_t tail;                // the owner takes from here
+};
+
+static struct program *programs = NULL;
+static size_t program_count = 0;
+static struct job *jobs = NULL;
+static size_t job_count = 0;
+static struct queue *queues = NULL;
+static struct timespec batch_start;
+static size_t worker_count = 0;
+static size_t green_jobs = 1;              // jobs a worker runs at once
+static uint64_t fuel = UINT64_MAX;         // per turn, with --green
+
+#define C0_BATCH_FUEL 10000
+
+/* c0_argc/c0_argv are shared, so jobs using the args natives take
+ * turns; the others never read them */
+static pthread_mutex_t args_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *status_names[] = {
+  "ok", "user_error", "assertion_failure", "memory_error", "value_error",
+  "arith_error", "bad_call", "yielded", "blocked"
+};
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [--threads=N] [--green=N [--fuel=F]]"
+          " [--heap-limit=BYTES] [manifest]\n", prog);
+  fprintf(stderr,
+          "Runs the jobs in manifest (default stdin), one \"program.bc0"
+          " [args...]\"\n"
+          "per line, and writes a JSON line per job to stdout.\n"
+          "  --threads=N   worker threads (default: online CPUs)\n"
+          "  --green=N     jobs each worker takes turns on (default 1)\n"
+          "  --fuel=F      backward branches and calls per turn"
+          " (default %d)\n"
+          "  --heap-limit=BYTES  what each job's heap may hold, with an"
+          " optional\n"
+          "                k, m or g suffix (default: no limit)\n",
+          C0_BATCH_FUEL);
+  exit(EXIT_FAILURE);
+}
+
+static double ms_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3
+       + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void *grow(void *p, size_t n, size_t size) {
+  p = realloc(p, n * size);
+  if (p == NULL) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  return p;
+}
+
+/* Parses a positive count with an optional k/m/g suffix, or exits
+ * with the usage */
+static unsigned long long count(const char *s, char *prog) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+  }
+  if (end == s || *end != '\0' || n < 1) usage(prog);
+  return n;
+}
+
+static char *copy(const char *s) {
+  char *c = xmalloc(strlen(s) + 1);
+  strcpy(c, s);
+  return c;
+}
+
+/*** manifest ***/
+
+static struct program *program_for(const char *path) {
+  for (size_t i = 0; i < program_count; i++) {
+    if (strcmp(programs[i].path, path) == 0) return &programs[i];
+  }
+  return NULL;
+}
+
+static bool calls_args(struct bc0_file *bc0) {
+  for (uint16_t i = 0; i < bc0->native_count; i++) {
+    if (bc0->native_pool[i].function_table_index < NATIVE_EOF) return true;
+  }
+  return false;
+}
+
+/* Loads every program before the workers start, so that contexts only
+ * ever read them */
+static void load_programs(void) {
+  for (size_t i = 0; i < program_count; i++) {
+    struct program *p = &programs[i];
+    p->bc0 = c0_load_program(p->path);
+    if (p->bc0 == NULL) continue;
+    if (!c0_natives_bind(p->bc0) || !c0_load_all_functions(p->bc0)) {
+      c0_free_program(p->bc0);
+      p->bc0 = NULL;
+      continue;
+    }
+    p->uses_args = calls_args(p->bc0);
+  }
+}
+
+static void read_manifest(FILE *f) {
+  size_t job_capacity = 0, program_capacity = 0, word_capacity = 0;
+  char *line = NULL;
+  char **words = NULL;
+  size_t len = 0;
+  size_t lineno = 0;
+  while (getline(&line, &len, f) != -1) {
+    lineno++;
+    int n = 0;
+    for (char *w = strtok(line, " \t\r\n"); w != NULL;
+         w = strtok(NULL, " \t\r\n")) {
+      if ((size_t) n == word_capacity) {
+        word_capacity = word_capacity == 0 ? 16 : 2 * word_capacity;
+        words = grow(words, word_capacity, sizeof *words);
+      }
+      words[n++] = w;
+    }
+    if (n == 0 || words[0][0] == '#') continue;
+
+    struct program *p = program_for(words[0]);
+    if (p == NULL) {
+      if (program_count == program_capacity) {
+        program_capacity = program_capacity == 0 ? 16 : 2 * program_capacity;
+        programs = grow(programs, program_capacity, sizeof *programs);
+      }
+      p = &programs[program_count++];
+      p->path = copy(words[0]);
+      p->bc0 = NULL;
+      p->uses_args = false;
+    }
+    if (job_count == job_capacity) {
+      job_capacity = job_capacity == 0 ? 64 : 2 * job_capacity;
+      jobs = grow(jobs, job_capacity, sizeof *jobs);
+    }
+    struct job *j = &jobs[job_count++];
+    j->line = lineno;
+    j->program = p - programs;
+    j->argc = n;
+    j->argv = xcalloc(n + 1, sizeof *j->argv);
+    for (int i = 0; i < n; i++) j->argv[i] = copy(words[i]);
+  }
+  free(words);
+  free(line);
+}
+
+/*** queues ***/
+
+static bool take_own(struct queue *q, size_t *job) {
+  pthread_mutex_lock(&q->lock);
+  bool found = q->head < q->tail;
+  if (found) *job = q->jobs[--q->tail];
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static bool steal(struct queue *q, size_t *job) {
+  pthread_mutex_lock(&q->lock);
+  bool found = q->head < q->tail;
+  if (found) *job = q->jobs[q->head++];
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static bool next_job(size_t self, size_t *job) {
+  if (take_own(&queues[self], job)) return true;
+  for (size_t k = 1; k < worker_count; k++) {
+    if (steal(&queues[(self + k) % worker_count], job)) return true;
+  }
+  return false;
+}
+
+/*** jobs ***/
+
+static void json_string(FILE *out, const char *s, size_t len) {
+  fputc('"', out);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+    else if (c == '\n') fputs("\\n", out);
+    else if (c == '\t') fputs("\\t", out);
+    else if (c < 0x20 || c == 0x7f) fprintf(out, "\\u%04x", c);
+    else fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+/* fault is NULL for a job that did not fail in the VM */
+static void report(struct job *j, const char *status, int32_t result,
+                   const char *error, struct c0_vm_fault *fault,
+                   uint64_t instructions, size_t peak_bytes, double ms,
+                   struct c0_output_capture *cap) {
+  pthread_mutex_lock(&out_lock);
+  fprintf(stdout, "{\"line\":%zu,\"program\":", j->line);
+  json_string(stdout, j->argv[0], strlen(j->argv[0]));
+  fputs(",\"args\":[", stdout);
+  for (int i = 1; i < j->argc; i++) {
+    if (i > 1) fputc(',', stdout);
+    json_string(stdout, j->argv[i], strlen(j->argv[i]));
+  }
+  fprintf(stdout, "],\"status\":\"%s\"", status);
+  if (error == NULL) fprintf(stdout, ",\"result\":%d", (int) result);
+  else {
+    fputs(",\"error\":", stdout);
+    json_string(stdout, error, strlen(error));
+  }
+  if (fault != NULL && fault->function >= 0) {
+    fputs(",\"function\":", stdout);
+    if (fault->function_name == NULL)
+      fprintf(stdout, "%d", fault->function);
+    else
+      json_string(stdout, fault->function_name,
+                  strlen(fault->function_name));
+    fprintf(stdout, ",\"pc\":%u", (unsigned) fault->pc);
+  }
+  fprintf(stdout, ",\"instructions\":%llu,\"peak_bytes\":%zu,\"ms\":%.3f"
+          ",\"done_ms\":%.3f,\"output\":", (unsigned long long) instructions,
+          peak_bytes, ms, ms_since(&batch_start));
+  json_string(stdout, cap->data, cap->len);
+  fputs("}\n", stdout);
+  pthread_mutex_unlock(&out_lock);
+}
+
+/* A job in progress on a worker */
+struct running {
+  struct job *job;
+  c0_vm *vm;
+  struct c0_output_capture cap;
+  struct timespec start;
+};
+
+/* Sets up r to run j; false if j is already over */
+static bool start_job(struct job *j, struct running *r) {
+  memset(r, 0, sizeof *r);
+  r->job = j;
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+  struct program *p = &programs[j->program];
+  r->vm = p->bc0 == NULL ? NULL : c0_vm_new(p->bc0, p->path);
+  if (r->vm == NULL) {
+    report(j, "load_error", 0, "cannot load program", NULL, 0, 0,
+           ms_since(&r->start), &r->cap);
+    return false;
+  }
+  c0_vm_start(r->vm, 0, NULL, 0);
+  return true;
+}
+
+/* Runs r on fuel; true once it is over and reported */
+static bool run_slice(struct running *r, uint64_t fuel) {
+  struct job *j = r->job;
+  bool uses_args = programs[j->program].uses_args;
+  c0_output_capture(&r->cap);
+  if (uses_args) {
+    pthread_mutex_lock(&args_lock);
+    c0_argc = j->argc;
+    c0_argv = j->argv;
+  }
+  c0_value result;
+  enum c0_vm_status status = c0_vm_resume(r->vm, fuel, &result);
+  if (uses_args) pthread_mutex_unlock(&args_lock);
+  c0_output_capture(NULL);
+  if (status == C0_VM_YIELDED) return false;
+
+  struct c0_vm_fault fault;
+  c0_vm_fault(r->vm, &fault);
+  struct c0_heap_stats heap;
+  c0_vm_heap_stats(r->vm, &heap);
+  report(j, status_names[status],
+         status == C0_VM_OK ? val2int(result) : 0,
+         status == C0_VM_OK ? NULL : fault.message, &fault,
+         c0_vm_instructions(r->vm), heap.peak, ms_since(&r->start),
+         &r->cap);
+  c0_vm_free(r->vm);
+  free(r->cap.data);
+  return true;
+}
+
+/* Keeps up to green_jobs jobs going at once, each for fuel at a time */
+static void *worker(void *arg) {
+  size_t self = (size_t) arg;
+  struct running *slots = xcalloc(green_jobs, sizeof *slots);
+  size_t active = 0;
+  bool more = true;
+  while (more || active > 0) {
+    size_t job;
+    while (more && active < green_jobs) {
+      if (!next_job(self, &job)) more = false;
+      else if (start_job(&jobs[job], &slots[active])) active++;
+    }
+    for (size_t i = 0; i < active; ) {
+      if (run_slice(&slots[i], fuel)) slots[i] = slots[--active];
+      else i++;
+    }
+  }
+  free(slots);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_count = online > 0 ? (size_t) online : 1;
+  const char *manifest = NULL;
+  uint64_t turn = C0_BATCH_FUEL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      worker_count = count(argv[i] + 10, argv[0]);
+    } else if (strncmp(argv[i], "--green=", 8) == 0) {
+      green_jobs = count(argv[i] + 8, argv[0]);
+    } else if (strncmp(argv[i], "--fuel=", 7) == 0) {
+      turn = count(argv[i] + 7, argv[0]);
+    } else if (strncmp(argv[i], "--heap-limit=", 13) == 0) {
+      c0_heap_options.limit = count(argv[i] + 13, argv[0]);
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv[0]);
+    } else if (manifest == NULL) {
+      manifest = argv[i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (green_jobs > 1) fuel = turn;
+
+  FILE *f = manifest == NULL || strcmp(manifest, "-") == 0
+          ? stdin : fopen(manifest, "r");
+  if (f == NULL) {
+    perror(manifest);
+    exit(EXIT_FAILURE);
+  }
+  read_manifest(f);
+  if (f != stdin) fclose(f);
+
+  clock_gettime(CLOCK_MONOTONIC, &batch_start);
+  load_programs();
+  c0_output_init(NULL);
+
+  queues = xcalloc(worker_count, sizeof *queues);
+  for (size_t w = 0; w < worker_count; w++) {
+    pthread_mutex_init(&queues[w].lock, NULL);
+    queues[w].jobs = xcalloc(job_count / worker_count + 1, sizeof(size_t));
+  }
+  for (size_t i = 0; i < job_count; i++) {
+    struct queue *q = &queues[i % worker_count];
+    q->jobs[q->tail++] = i;
+  }
+
+  pthread_t *threads = xcalloc(worker_count, sizeof *threads);
+  // The main thread is worker 0
+  for (size_t w = 1; w < worker_count; w++)
+    pthread_create(&threads[w], NULL, worker, (void *) w);
+  worker((void *) 0);
+  for (size_t w = 1; w < worker_count; w++)
+    pthread_join(threads[w], NULL);
+  fprintf(stderr, "c0vm-batch: %zu jobs, %zu programs, %zu threads,"
+          " %.3f ms\n", job_count, program_count, worker_count,
+          ms_since(&batch_start));
+
+  for (size_t w = 0; w < worker_count; w++) {
+    pthread_mutex_destroy(&queues[w].lock);
+    free(queues[w].jobs);
+  }
+  free(queues);
+  free(threads);
+  c0_output_free();
+  for (size_t i = 0; i < job_count; i++) {
+    for (int k = 0; k < jobs[i].argc; k++) free(jobs[i].argv[k]);
+    free(jobs[i].argv);
+  }
+  free(jobs);
+  for (size_t i = 0; i < program_count; i++) {
+    c0_free_program(programs[i].bc0);
+    free(programs[i].path);
+  }
+  free(programs);
+  return 0;
+}
@@ -0,0 +1,236 @@
+/* C0VM bytecode builder
+ * Every pool is a growable array that becomes the matching bc0_file
+ * field as is. Branches are emitted with a zero offset and patched in
+ * c0_builder_finish, once every label has a position.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_opcodes.h"
+#include "lib/c0vm_builder.h"
+
+#define UNBOUND UINT32_MAX
+
+typedef struct {
+  uint16_t fn;
+  uint32_t pc;          // UNBOUND until c0_builder_bind
+} label_info;
+
+typedef struct {
+  uint16_t fn;
+  uint32_t pc;          // of the branch instruction
+  c0_label target;
+} fixup;
+
+typedef struct {
+  struct function_info info;
+  size_t capacity;
+} function_buf;
+
+struct c0_builder {
+  int32_t *ints;        size_t int_count, int_capacity;
+  char *strings;        size_t string_size, string_capacity;
+  struct native_info *natives; size_t native_count, native_capacity;
+  function_buf *fns;    size_t fn_count, fn_capacity;
+  label_info *labels;   size_t label_count, label_capacity;
+  fixup *fixups;        size_t fixup_count, fixup_capacity;
+  size_t current;       // function being emitted
+  bool begun;           // false until the first c0_builder_begin
+};
+
+// Makes room for one more element of size elt in *array
+static void *reserve(void *array, size_t *capacity, size_t count, size_t elt) {
+  if (count < *capacity) return array;
+  *capacity = *capacity == 0 ? 16 : 2 * *capacity;
+  void *grown = xcalloc(*capacity, elt);
+  if (array != NULL) memcpy(grown, array, count * elt);
+  free(array);
+  return grown;
+}
+
+c0_builder *c0_builder_new(void) {
+  return xcalloc(1, sizeof(c0_builder));
+}
+
+uint16_t c0_builder_int(c0_builder *b, int32_t x) {
+  REQUIRES(b != NULL);
+  for (size_t i = 0; i < b->int_count; i++) {
+    if (b->ints[i] == x) return (uint16_t) i;
+  }
+  REQUIRES(b->int_count < UINT16_MAX);
+  b->ints = reserve(b->ints, &b->int_capacity, b->int_count, sizeof *b->ints);
+  b->ints[b->int_count] = x;
+  return (uint16_t) b->int_count++;
+}
+
+uint16_t c0_builder_string(c0_builder *b, const char *s) {
+  REQUIRES(b != NULL && s != NULL);
+  size_t len = strlen(s) + 1;
+  for (size_t off = 0; off < b->string_size; off += strlen(&b->strings[off]) + 1) {
+    if (strcmp(&b->strings[off], s) == 0) return (uint16_t) off;
+  }
+  REQUIRES(b->string_size + len <= UINT16_MAX);
+  while (b->string_capacity < b->string_size + len) {
+    b->strings = reserve(b->strings, &b->string_capacity,
+                         b->string_capacity, sizeof(char));
+  }
+  memcpy(&b->strings[b->string_size], s, len);
+  b->string_size += len;
+  return (uint16_t)(b->string_size - len);
+}
+
+uint16_t c0_builder_native(c0_builder *b, uint16_t num_args,
+                           uint16_t table_index) {
+  REQUIRES(b != NULL);
+  for (size_t i = 0; i < b->native_count; i++) {
+    if (b->natives[i].function_table_index == table_index) {
+      REQUIRES(b->natives[i].num_args == num_args);
+      return (uint16_t) i;
+    }
+  }
+  REQUIRES(b->native_count < UINT16_MAX);
+  b->natives = reserve(b->natives, &b->native_capacity, b->native_count,
+                       sizeof *b->natives);
+  b->natives[b->native_count].num_args = num_args;
+  b->natives[b->native_count].function_table_index = table_index;
+  return (uint16_t) b->native_count++;
+}
+
+uint16_t c0_builder_function(c0_builder *b, uint8_t num_args,
+                             uint8_t num_vars) {
+  REQUIRES(b != NULL);
+  REQUIRES(num_args <= num_vars);
+  REQUIRES(b->fn_count < UINT16_MAX);
+  b->fns = reserve(b->fns, &b->fn_capacity, b->fn_count, sizeof *b->fns);
+  function_buf *f = &b->fns[b->fn_count];
+  f->info.num_args = num_args;
+  f->info.num_vars = num_vars;
+  f->info.code_length = 0;
+  f->info.code = NULL;
+  f->capacity = 0;
+  return (uint16_t) b->fn_count++;
+}
+
+void c0_builder_begin(c0_builder *b, uint16_t fn) {
+  REQUIRES(b != NULL && fn < b->fn_count);
+  b->current = fn;
+  b->begun = true;
+}
+
+c0_label c0_builder_label(c0_builder *b) {
+  REQUIRES(b != NULL && b->label_count < UNBOUND);
+  b->labels = reserve(b->labels, &b->label_capacity, b->label_count,
+                      sizeof *b->labels);
+  b->labels[b->label_count].fn = 0;
+  b->labels[b->label_count].pc = UNBOUND;
+  return (c0_label) b->label_count++;
+}
+
+static function_buf *current_fn(c0_builder *b) {
+  REQUIRES(b != NULL);
+  REQUIRES(b->begun);   // c0_builder_begin first
+  return &b->fns[b->current];
+}
+
+void c0_builder_bind(c0_builder *b, c0_label l) {
+  function_buf *f = current_fn(b);
+  REQUIRES(l < b->label_count);
+  REQUIRES(b->labels[l].pc == UNBOUND);
+  b->labels[l].fn = (uint16_t) b->current;
+  b->labels[l].pc = f->info.code_length;
+}
+
+static void put(c0_builder *b, const ubyte *bytes, size_t n) {
+  function_buf *f = current_fn(b);
+  REQUIRES(f->info.code_length + n <= UINT16_MAX);
+  while (f->capacity < f->info.code_length + n) {
+    f->info.code = reserve(f->info.code, &f->capacity, f->capacity,
+                           sizeof(ubyte));
+  }
+  memcpy(&f->info.code[f->info.code_length], bytes, n);
+  f->info.code_length += n;
+}
+
+void c0_emit(c0_builder *b, ubyte op) {
+  REQUIRES(c0_opcode_length(op) == 1);
+  put(b, &op, 1);
+}
+
+void c0_emit_byte(c0_builder *b, ubyte op, ubyte x) {
+  REQUIRES(c0_opcode_length(op) == 2);
+  ubyte insn[2] = { op, x };
+  put(b, insn, 2);
+}
+
+void c0_emit_index(c0_builder *b, ubyte op, uint16_t c) {
+  REQUIRES(c0_opcode_length(op) == 3);
+  REQUIRES(op != GOTO && !(IF_CMPEQ <= op && op <= IF_ICMPLE));
+  ubyte insn[3] = { op, (ubyte)(c >> 8), (ubyte)(c & 0xFF) };
+  put(b, insn, 3);
+}
+
+void c0_emit_branch(c0_builder *b, ubyte op, c0_label l) {
+  REQUIRES(op == GOTO || (IF_CMPEQ <= op && op <= IF_ICMPLE));
+  REQUIRES(l < b->label_count);
+  b->fixups = reserve(b->fixups, &b->fixup_capacity, b->fixup_count,
+                      sizeof *b->fixups);
+  b->fixups[b->fixup_count].fn = (uint16_t) b->current;
+  b->fixups[b->fixup_count].pc = current_fn(b)->info.code_length;
+  b->fixups[b->fixup_count].target = l;
+  b->fixup_count++;
+
+  ubyte insn[3] = { op, 0, 0 };
+  put(b, insn, 3);
+}
+
+struct bc0_file *c0_builder_finish(c0_builder *b) {
+  REQUIRES(b != NULL && b->fn_count > 0);
+
+  for (size_t i = 0; i < b->fixup_count; i++) {
+    fixup *x = &b->fixups[i];
+    label_info *l = &b->labels[x->target];
+    REQUIRES(l->pc != UNBOUND);     // every label used must be bound
+    REQUIRES(l->fn == x->fn);       // branches cannot leave a function
+    int32_t delta = (int32_t) l->pc - (int32_t) x->pc;
+    REQUIRES(-32768 <= delta && delta <= 32767);   // fits the operand
+    int16_t offset = (int16_t) delta;
+    ubyte *code = b->fns[x->fn].info.code;
+    code[x->pc + 1] = (ubyte)((uint16_t) offset >> 8);
+    code[x->pc + 2] = (ubyte)((uint16_t) offset & 0xFF);
+  }
+
+  struct bc0_file *bc0 = xcalloc(1, sizeof *bc0);
+  bc0->magic = 0xc0c0ffee;
+  bc0->version = (BYTECODE_VERSION << 1) | 1;   // low bit: 64-bit target
+  bc0->int_count = (uint16_t) b->int_count;
+  bc0->int_pool = xcalloc(b->int_count + 1, sizeof(int32_t));
+  if (b->int_count > 0)
+    memcpy(bc0->int_pool, b->ints, b->int_count * sizeof(int32_t));
+  bc0->string_count = (uint16_t) b->string_size;
+  bc0->string_pool = xcalloc(b->string_size + 1, sizeof(char));
+  if (b->string_size > 0)
+    memcpy(bc0->string_pool, b->strings, b->string_size);
+  bc0->native_count = (uint16_t) b->native_count;
+  bc0->native_pool = xcalloc(b->native_count + 1, sizeof(struct native_info));
+  if (b->native_count > 0)
+    memcpy(bc0->native_pool, b->natives,
+           b->native_count * sizeof(struct native_info));
+  bc0->function_count = (uint16_t) b->fn_count;
+  bc0->function_pool = xcalloc(b->fn_count, sizeof(struct function_info));
+  for (size_t i = 0; i < b->fn_count; i++) {
+    bc0->function_pool[i] = b->fns[i].info;
+    if (bc0->function_pool[i].code == NULL)
+      bc0->function_pool[i].code = xcalloc(1, sizeof(ubyte));
+  }
+
+  free(b->ints);
+  free(b->strings);
+  free(b->natives);
+  free(b->fns);
+  free(b->labels);
+  free(b->fixups);
+  free(b);
+  return bc0;
+}
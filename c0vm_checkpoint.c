@@ -0,0 +1,463 @@
+/* C0VM checkpoints
+ * The file, after struct header:
+ *
+ *   sizes         block_count times the size of a heap block (u64)
+ *   blocks        for each, its bytes, then the pointers found in it:
+ *                 a count (u64) and that many struct relocation
+ *   frames        frame_count times, outermost first: fn (u16), pc
+ *                 (u64), the function's num_vars values, then the
+ *                 operand stack: a count (u64) and its values from the
+ *                 bottom up
+ *
+ * A value is a kind byte followed by an int32_t or a struct ref. The
+ * sizes come first so that a restore can allocate every block before
+ * it meets pointers to them.
+ */
+#define _DEFAULT_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0v_stack.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_checkpoint.h"
+#include "lib/c0vm_exec.h"
+#include "lib/c0vm_heap.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_output.h"
+#include "lib/c0vm_recorder.h"
+
+#define BYTE_ORDER_MARK 0x01020304
+
+struct c0_checkpoint_options c0_checkpoint_options = { NULL, 0 };
+
+struct header {
+  char magic[8];
+  uint32_t format;
+  uint32_t byte_order;        // BYTE_ORDER_MARK as written
+  uint32_t word_size;
+  uint32_t reserved;
+  uint64_t program_id;
+  uint64_t block_count;
+  uint64_t frame_count;
+};
+
+/* Where a pointer points: into a heap block, the string pool or
+ * nowhere, and how far in */
+#define REF_NULL UINT64_MAX
+#define REF_STRINGS (UINT64_MAX - 1)
+
+struct ref {
+  uint64_t block;
+  uint64_t offset;
+};
+
+struct relocation {
+  uint64_t offset;            // in the block being read
+  struct ref to;
+};
+
+static uint64_t program_id;
+static pid_t writer = 0;      // a child still writing a checkpoint
+static volatile sig_atomic_t requested = 0;
+
+static void request(int sig) {
+  (void) sig;
+  requested = 1;
+}
+
+static double seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/*** Writing ***/
+
+struct index_entry {
+  uintptr_t base;
+  size_t bytes;
+  uint64_t block;
+};
+
+struct writer {
+  FILE *f;
+  struct bc0_file *bc0;
+  struct index_entry *index;  // the blocks by address
+  size_t count;
+  uintptr_t low, high;        // what they span
+  bool ok;
+};
+
+static int compare_entries(const void *a, const void *b) {
+  uintptr_t x = ((const struct index_entry *) a)->base;
+  uintptr_t y = ((const struct index_entry *) b)->base;
+  return x < y ? -1 : x > y;
+}
+
+static void index_blocks(struct writer *w, struct c0_heap_block *blocks,
+                         size_t count) {
+  w->index = xcalloc(count + 1, sizeof *w->index);
+  w->count = 0;
+  w->low = UINTPTR_MAX;
+  w->high = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (blocks[i].base == NULL) continue;
+    struct index_entry *e = &w->index[w->count++];
+    e->base = (uintptr_t) blocks[i].base;
+    e->bytes = blocks[i].bytes == 0 ? 1 : blocks[i].bytes;
+    e->block = i;
+    if (e->base < w->low) w->low = e->base;
+    if (e->base + e->bytes > w->high) w->high = e->base + e->bytes;
+  }
+  qsort(w->index, w->count, sizeof *w->index, compare_entries);
+}
+
+/* Where p points, if it is NULL, a string literal or in a block */
+static bool to_ref(struct writer *w, uintptr_t p, struct ref *r) {
+  uintptr_t strings = (uintptr_t) w->bc0->string_pool;
+  if (p == 0) {
+    r->block = REF_NULL;
+    r->offset = 0;
+    return true;
+  }
+  if (p >= strings && p < strings + w->bc0->string_count) {
+    r->block = REF_STRINGS;
+    r->offset = p - strings;
+    return true;
+  }
+  if (p < w->low || p >= w->high) return false;
+  size_t lo = 0, hi = w->count;     // the last block starting at or below p
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (w->index[mid].base <= p) lo = mid;
+    else hi = mid;
+  }
+  struct index_entry *e = &w->index[lo];
+  if (p < e->base || p >= e->base + e->bytes) return false;
+  r->block = e->block;
+  r->offset = p - e->base;
+  return true;
+}
+
+static void put(struct writer *w, const void *p, size_t n) {
+  if (w->ok && n > 0 && fwrite(p, 1, n, w->f) != n) w->ok = false;
+}
+
+static void put_value(struct writer *w, c0_value v) {
+  uint8_t kind = v.kind;
+  put(w, &kind, 1);
+  if (v.kind == C0_INTEGER) {
+    put(w, &v.payload.i, sizeof v.payload.i);
+    return;
+  }
+  struct ref r;
+  if (!to_ref(w, (uintptr_t) v.payload.p, &r)) {
+    fprintf(stderr, "c0vm: checkpoint: a pointer to memory that is not"
+            " on the heap\n");
+    w->ok = false;
+    return;
+  }
+  put(w, &r, sizeof r);
+}
+
+static void put_stack(struct writer *w, c0v_stack_t S) {
+  uint64_t n = c0v_stack_size(S);
+  c0_value *values = xcalloc(n + 1, sizeof *values);
+  for (uint64_t i = n; i > 0; i--) values[i - 1] = c0v_pop(S);
+  put(w, &n, sizeof n);
+  for (uint64_t i = 0; i < n; i++) {
+    put_value(w, values[i]);
+    c0v_push(S, values[i]);
+  }
+  free(values);
+}
+
+/* A block's bytes and the words in it that look like pointers */
+static void put_block(struct writer *w, struct c0_heap_block *b) {
+  put(w, b->base, b->bytes);
+  struct relocation *found = NULL;
+  size_t count = 0, capacity = 0;
+  for (size_t off = 0; off + sizeof(uintptr_t) <= b->bytes;
+       off += sizeof(uintptr_t)) {
+    uintptr_t word;
+    memcpy(&word, (char *) b->base + off, sizeof word);
+    struct ref r;
+    if (word == 0 || !to_ref(w, word, &r)) continue;
+    if (count == capacity) {
+      capacity = capacity == 0 ? 64 : 2 * capacity;
+      struct relocation *grown = realloc(found, capacity * sizeof *found);
+      if (grown == NULL) {
+        w->ok = false;
+        break;
+      }
+      found = grown;
+    }
+    found[count].offset = off;
+    found[count].to = r;
+    count++;
+  }
+  uint64_t n = count;
+  put(w, &n, sizeof n);
+  put(w, found, count * sizeof *found);
+  free(found);
+}
+
+static bool write_checkpoint(struct c0_exec *exec, const char *path) {
+  size_t len = strlen(path) + 5;
+  char *tmp = xmalloc(len);
+  snprintf(tmp, len, "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) {
+    perror(tmp);
+    free(tmp);
+    return false;
+  }
+
+  struct writer w = { f, exec->bc0, NULL, 0, 0, 0, true };
+  size_t block_count;
+  struct c0_heap_block *blocks = c0_heap_blocks(&block_count);
+  index_blocks(&w, blocks, block_count);
+  struct c0_exec_frame *frames;
+  size_t frame_count = c0_exec_frames(exec, &frames);
+
+  struct header h;
+  memset(&h, 0, sizeof h);
+  strcpy(h.magic, C0_CHECKPOINT_MAGIC);
+  h.format = C0_CHECKPOINT_FORMAT;
+  h.byte_order = BYTE_ORDER_MARK;
+  h.word_size = sizeof(void *);
+  h.program_id = program_id;
+  h.block_count = block_count;
+  h.frame_count = frame_count;
+  put(&w, &h, sizeof h);
+  for (size_t i = 0; i < block_count; i++) {
+    uint64_t bytes = blocks[i].bytes;
+    put(&w, &bytes, sizeof bytes);
+  }
+  for (size_t i = 0; i < block_count; i++) put_block(&w, &blocks[i]);
+
+  for (size_t i = 0; i < frame_count; i++) {
+    uint64_t pc = frames[i].pc;
+    put(&w, &frames[i].fn, sizeof frames[i].fn);
+    put(&w, &pc, sizeof pc);
+    uint8_t num_vars = exec->bc0->function_pool[frames[i].fn].num_vars;
+    for (uint8_t v = 0; v < num_vars; v++) put_value(&w, frames[i].V[v]);
+    put_stack(&w, frames[i].S);
+  }
+
+  free(frames);
+  free(w.index);
+  free(blocks);
+  if (fclose(f) != 0) w.ok = false;
+  if (w.ok && rename(tmp, path) != 0) {
+    perror(path);
+    w.ok = false;
+  }
+  if (!w.ok) {
+    fprintf(stderr, "c0vm: checkpoint to %s failed\n", path);
+    unlink(tmp);
+  }
+  free(tmp);
+  return w.ok;
+}
+
+/* Forks a child to write the checkpoint; false if the last one is
+ * still being written */
+static bool take(struct c0_exec *exec) {
+  if (writer > 0 && waitpid(writer, NULL, WNOHANG) == 0) return false;
+  // What was printed before the checkpoint should not be lost with it
+  c0_output_flush();
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool ok = write_checkpoint(exec, c0_checkpoint_options.file);
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  if (pid < 0) perror("fork");
+  writer = pid > 0 ? pid : 0;
+  return true;
+}
+
+
+/*** Reading ***/
+
+struct reader {
+  FILE *f;
+  struct bc0_file *bc0;
+  void **base;                // the new address of each block
+  uint64_t *sizes;
+  uint64_t count;
+  bool ok;
+};
+
+static void get(struct reader *r, void *p, size_t n) {
+  if (r->ok && n > 0 && fread(p, 1, n, r->f) != n) r->ok = false;
+}
+
+static void *from_ref(struct reader *r, struct ref ref) {
+  if (ref.block == REF_NULL) return NULL;
+  if (ref.block == REF_STRINGS) {
+    if (ref.offset < r->bc0->string_count)
+      return r->bc0->string_pool + ref.offset;
+  } else if (ref.block < r->count
+             && ref.offset < (r->sizes[ref.block] == 0
+                              ? 1 : r->sizes[ref.block])) {
+    return (char *) r->base[ref.block] + ref.offset;
+  }
+  r->ok = false;
+  return NULL;
+}
+
+static c0_value get_value(struct reader *r) {
+  uint8_t kind = C0_INTEGER;
+  get(r, &kind, 1);
+  if (kind == C0_INTEGER) {
+    int32_t i = 0;
+    get(r, &i, sizeof i);
+    return int2val(i);
+  }
+  if (kind != C0_POINTER) r->ok = false;
+  struct ref ref = { REF_NULL, 0 };
+  get(r, &ref, sizeof ref);
+  return ptr2val(from_ref(r, ref));
+}
+
+static void corrupt(const char *path) {
+  fprintf(stderr, "c0vm: %s: not a usable checkpoint\n", path);
+  exit(EXIT_FAILURE);
+}
+
+static void read_checkpoint(struct c0_exec *exec, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  struct bc0_file *bc0 = exec->bc0;
+  struct reader r = { f, bc0, NULL, NULL, 0, true };
+  struct header h;
+  get(&r, &h, sizeof h);
+  if (!r.ok || memcmp(h.magic, C0_CHECKPOINT_MAGIC, 8) != 0
+      || h.format != C0_CHECKPOINT_FORMAT || h.byte_order != BYTE_ORDER_MARK
+      || h.word_size != sizeof(void *) || h.frame_count == 0)
+    corrupt(path);
+  if (h.program_id != program_id) {
+    fprintf(stderr, "c0vm: %s is a checkpoint of another program\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // Every block first, then their contents, which point to each other
+  r.count = h.block_count;
+  r.sizes = xcalloc(r.count + 1, sizeof *r.sizes);
+  r.base = xcalloc(r.count + 1, sizeof *r.base);
+  get(&r, r.sizes, r.count * sizeof *r.sizes);
+  if (!r.ok) corrupt(path);
+  for (uint64_t i = 0; i < r.count; i++)
+    r.base[i] = r.sizes[i] == 0 ? c0_object_alloc(0)
+                                : c0_array_alloc(r.sizes[i], 1);
+  for (uint64_t i = 0; i < r.count && r.ok; i++) {
+    get(&r, r.base[i], r.sizes[i]);
+    uint64_t n = 0;
+    get(&r, &n, sizeof n);
+    for (uint64_t k = 0; k < n && r.ok; k++) {
+      struct relocation rel;
+      get(&r, &rel, sizeof rel);
+      void *p = from_ref(&r, rel.to);
+      if (rel.offset + sizeof p > r.sizes[i]) r.ok = false;
+      else memcpy((char *) r.base[i] + rel.offset, &p, sizeof p);
+    }
+  }
+
+  struct c0_exec_frame *frames = xcalloc(h.frame_count, sizeof *frames);
+  for (uint64_t i = 0; i < h.frame_count && r.ok; i++) {
+    uint64_t pc = 0, n = 0;
+    get(&r, &frames[i].fn, sizeof frames[i].fn);
+    get(&r, &pc, sizeof pc);
+    if (!r.ok || frames[i].fn >= bc0->function_count
+        || pc >= bc0->function_pool[frames[i].fn].code_length)
+      corrupt(path);
+    frames[i].pc = pc;
+    uint8_t num_vars = bc0->function_pool[frames[i].fn].num_vars;
+    frames[i].V = xcalloc(num_vars + 1, sizeof *frames[i].V);
+    for (uint8_t v = 0; v < num_vars; v++) frames[i].V[v] = get_value(&r);
+    frames[i].S = c0v_stack_new();
+    get(&r, &n, sizeof n);
+    for (uint64_t k = 0; k < n && r.ok; k++) c0v_push(frames[i].S, get_value(&r));
+  }
+  if (!r.ok || fgetc(f) != EOF) corrupt(path);
+  fclose(f);
+  free(r.sizes);
+  free(r.base);
+  c0_exec_restore(exec, frames, h.frame_count);
+  free(frames);
+}
+
+
+/*** Running ***/
+
+/* Natives whose libraries keep state a checkpoint would miss */
+static const char *outside_state(struct bc0_file *bc0) {
+  for (uint16_t i = 0; i < bc0->native_count; i++) {
+    uint16_t index = bc0->native_pool[i].function_table_index;
+    if (index <= NATIVE_ARGS_STRING) return "args";
+    if (index >= NATIVE_C_ADDCH && index <= NATIVE_CC_WUNDERON)
+      return "curses";
+    if (index >= NATIVE_FILE_CLOSE && index <= NATIVE_FILE_READLINE)
+      return "file";
+    if (index >= NATIVE_IMAGE_CLONE && index <= NATIVE_IMAGE_WIDTH)
+      return "img";
+  }
+  return NULL;
+}
+
+int c0_checkpoint_execute(struct bc0_file *bc0, const char *restore) {
+  const char *library = outside_state(bc0);
+  if (library != NULL) {
+    fprintf(stderr, "c0vm: cannot checkpoint a program that uses <%s>\n",
+            library);
+    exit(EXIT_FAILURE);
+  }
+  // The checkpoint needs to find every block, and the code it hashes
+  c0_heap_options.track = true;
+  if (!c0_load_all_functions(bc0)) exit(EXIT_FAILURE);
+  program_id = c0_program_id(bc0);
+
+  struct c0_exec exec = { bc0, &c0_recorder, c0_natives_resolve(bc0), NULL,
+                          NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 };
+  if (restore != NULL) read_checkpoint(&exec, restore);
+  else c0_exec_start(&exec, 0, NULL);
+
+  const char *file = c0_checkpoint_options.file;
+  if (file != NULL) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = request;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+  struct timespec last;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  c0_value result;
+  while (true) {
+    exec.fuel = C0_CHECKPOINT_SLICE;
+    if (c0_exec_run(&exec, &result) == C0_EXEC_DONE) break;
+    if (file == NULL) continue;
+    double every = c0_checkpoint_options.every;
+    bool due = requested || (every > 0 && seconds_since(&last) >= every);
+    if (due && take(&exec)) {
+      requested = 0;
+      clock_gettime(CLOCK_MONOTONIC, &last);
+    }
+  }
+  if (writer > 0) waitpid(writer, NULL, 0);
+  free(exec.natives);
+  return val2int(result);
+}
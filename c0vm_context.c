@@ -0,0 +1,260 @@
+/* C0VM contexts
+ * A call installs the context's heap and error trap on the calling
+ * thread for its duration. The execution state and the trap live in
+ * the context rather than in c0_vm_call's frame, so both are still
+ * valid after the longjmp from a runtime error. The context records
+ * every instruction into a one-slot ring, which holds the failing one
+ * after the longjmp.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_debug.h"
+#include "lib/c0vm_errors.h"
+#include "lib/c0vm_exec.h"
+#include "lib/c0vm_heap.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_output.h"
+
+/* Program arguments for the args natives, see lib/c0vm_context.h */
+int c0_argc;
+char **c0_argv;
+
+struct c0_vm {
+  struct bc0_file *bc0;
+  bool owns_program;
+  char *filename;                 // NULL if unknown
+  struct c0_debug_info *dbg;      // names, loaded on first lookup
+  struct c0_heap *heap;
+  struct c0_record slot;          // no dumps, so a one-slot ring
+  struct c0_recorder recorder;
+  struct c0_exec exec;
+  struct c0_trap trap;
+  bool suspended;                 // a started call has not finished
+  enum c0_vm_status status;       // of the last failed call
+  struct c0_record fault;         // its failing instruction
+};
+
+c0_vm *c0_vm_new(struct bc0_file *bc0, const char *filename) {
+  REQUIRES(bc0 != NULL);
+  if (!c0_natives_bind(bc0) || !c0_load_all_functions(bc0)) return NULL;
+
+  c0_vm *vm = xcalloc(1, sizeof *vm);
+  vm->bc0 = bc0;
+  if (filename != NULL) {
+    vm->filename = xmalloc(strlen(filename) + 1);
+    strcpy(vm->filename, filename);
+  }
+  vm->heap = c0_heap_new();
+  vm->recorder.ring = &vm->slot;
+  vm->recorder.program = bc0;
+  vm->exec.bc0 = bc0;
+  vm->exec.recorder = &vm->recorder;
+  vm->exec.natives = c0_natives_resolve(bc0);
+  return vm;
+}
+
+c0_vm *c0_vm_open(const char *filename) {
+  REQUIRES(filename != NULL);
+  struct bc0_file *bc0 = c0_load_program(filename);
+  if (bc0 == NULL) return NULL;
+  c0_vm *vm = c0_vm_new(bc0, filename);
+  if (vm == NULL) {
+    c0_free_program(bc0);
+    return NULL;
+  }
+  vm->owns_program = true;
+  return vm;
+}
+
+void c0_vm_free(c0_vm *vm) {
+  if (vm == NULL) return;
+  c0_exec_unwind(&vm->exec);
+  c0_heap_free(vm->heap);
+  free(vm->exec.natives);
+  c0_debug_free(vm->dbg);
+  free(vm->filename);
+  if (vm->owns_program) c0_free_program(vm->bc0);
+  free(vm);
+}
+
+struct bc0_file *c0_vm_program(c0_vm *vm) {
+  REQUIRES(vm != NULL);
+  return vm->bc0;
+}
+
+static struct c0_debug_info *debug_info(c0_vm *vm) {
+  if (vm->dbg == NULL) vm->dbg = c0_debug_load(vm->filename);
+  return vm->dbg;
+}
+
+int c0_vm_function(c0_vm *vm, const char *name) {
+  REQUIRES(vm != NULL && name != NULL);
+  if (vm->filename == NULL) return -1;
+  debug_info(vm);
+  for (uint16_t i = 0; i < vm->dbg->function_count; i++) {
+    char *f = vm->dbg->function_names[i];
+    if (f != NULL && strcmp(f, name) == 0) return i;
+  }
+  return -1;
+}
+
+static enum c0_vm_status bad_call(c0_vm *vm) {
+  vm->status = C0_VM_BAD_CALL;
+  return C0_VM_BAD_CALL;
+}
+
+/* Checks a call of fn and sets it up */
+static enum c0_vm_status start(c0_vm *vm, int fn, const c0_value *args,
+                               size_t nargs) {
+  if (vm->suspended) {
+    snprintf(vm->trap.message, sizeof vm->trap.message,
+             "a call is suspended");
+    return bad_call(vm);
+  }
+  if (fn < 0 || fn >= vm->bc0->function_count) {
+    snprintf(vm->trap.message, sizeof vm->trap.message,
+             "no function %d", fn);
+    return bad_call(vm);
+  }
+  if (nargs != vm->bc0->function_pool[fn].num_args) {
+    snprintf(vm->trap.message, sizeof vm->trap.message,
+             "function %d takes %u arguments, not %zu", fn,
+             (unsigned) vm->bc0->function_pool[fn].num_args, nargs);
+    return bad_call(vm);
+  }
+  c0_exec_start(&vm->exec, (uint16_t) fn, (c0_value *) args);
+  vm->suspended = true;
+  return C0_VM_OK;
+}
+
+/* Runs the started call on fuel, stopping at natives that would block
+ * if asked to */
+static enum c0_vm_status run(c0_vm *vm, uint64_t fuel, bool can_block,
+                             c0_value *result) {
+  struct c0_heap *prev_heap = c0_heap_use(vm->heap);
+  struct c0_trap *prev_trap = c0_set_trap(&vm->trap);
+  enum c0_vm_status status = C0_VM_OK;
+  vm->exec.fuel = fuel;
+  vm->exec.would_block = can_block ? c0_output_would_block : NULL;
+  if (setjmp(vm->trap.env) == 0) {
+    c0_value v;
+    switch (c0_exec_run(&vm->exec, &v)) {
+    case C0_EXEC_DONE:
+      vm->suspended = false;
+      if (result != NULL) *result = v;
+      break;
+    case C0_EXEC_OUT_OF_FUEL:
+      status = C0_VM_YIELDED;
+      break;
+    case C0_EXEC_BLOCKED:
+      status = C0_VM_BLOCKED;
+      break;
+    }
+  } else {
+    c0_exec_unwind(&vm->exec);
+    vm->suspended = false;
+    c0_heap_reset();
+    // The statuses follow the order of enum c0_error_kind
+    status = C0_VM_USER_ERROR + vm->trap.kind;
+    vm->status = status;
+    vm->fault = vm->slot;
+  }
+  c0_set_trap(prev_trap);
+  c0_heap_use(prev_heap);
+  return status;
+}
+
+enum c0_vm_status c0_vm_call(c0_vm *vm, int fn, const c0_value *args,
+                             size_t nargs, c0_value *result) {
+  REQUIRES(vm != NULL && (args != NULL || nargs == 0));
+  enum c0_vm_status status = start(vm, fn, args, nargs);
+  if (status != C0_VM_OK) return status;
+  return run(vm, C0_FUEL_UNLIMITED, false, result);
+}
+
+enum c0_vm_status c0_vm_start(c0_vm *vm, int fn, const c0_value *args,
+                              size_t nargs) {
+  REQUIRES(vm != NULL && (args != NULL || nargs == 0));
+  return start(vm, fn, args, nargs);
+}
+
+enum c0_vm_status c0_vm_resume(c0_vm *vm, uint64_t fuel, c0_value *result) {
+  REQUIRES(vm != NULL && fuel > 0);
+  if (!vm->suspended) {
+    snprintf(vm->trap.message, sizeof vm->trap.message, "no call to resume");
+    return bad_call(vm);
+  }
+  return run(vm, fuel, true, result);
+}
+
+bool c0_vm_suspended(c0_vm *vm) {
+  REQUIRES(vm != NULL);
+  return vm->suspended;
+}
+
+enum c0_vm_status c0_vm_call_name(c0_vm *vm, const char *name,
+                                  const c0_value *args, size_t nargs,
+                                  c0_value *result) {
+  int fn = c0_vm_function(vm, name);
+  if (fn < 0) {
+    snprintf(vm->trap.message, sizeof vm->trap.message,
+             "no function named %s", name);
+    return bad_call(vm);
+  }
+  return c0_vm_call(vm, fn, args, nargs, result);
+}
+
+const char *c0_vm_error(c0_vm *vm) {
+  REQUIRES(vm != NULL);
+  return vm->trap.message;
+}
+
+void c0_vm_fault(c0_vm *vm, struct c0_vm_fault *fault) {
+  REQUIRES(vm != NULL && fault != NULL);
+  memset(fault, 0, sizeof *fault);
+  fault->status = vm->status;
+  fault->function = -1;
+  if (vm->status == C0_VM_OK) return;
+  fault->message = vm->trap.message;
+  if (vm->status == C0_VM_BAD_CALL) return;
+  fault->function = vm->fault.fn;
+  fault->pc = vm->fault.pc;
+  fault->opcode = vm->fault.opcode;
+  fault->depth = vm->fault.depth;
+  struct c0_debug_info *dbg = vm->filename == NULL ? NULL : debug_info(vm);
+  if (dbg != NULL && vm->fault.fn < dbg->function_count)
+    fault->function_name = dbg->function_names[vm->fault.fn];
+}
+
+uint64_t c0_vm_instructions(c0_vm *vm) {
+  REQUIRES(vm != NULL);
+  return vm->recorder.next;
+}
+
+void c0_vm_reset(c0_vm *vm) {
+  REQUIRES(vm != NULL);
+  c0_exec_unwind(&vm->exec);
+  vm->suspended = false;
+  struct c0_heap *prev = c0_heap_use(vm->heap);
+  c0_heap_reset();
+  c0_heap_use(prev);
+}
+
+void c0_vm_set_heap_limit(c0_vm *vm, size_t bytes) {
+  REQUIRES(vm != NULL);
+  struct c0_heap *prev = c0_heap_use(vm->heap);
+  c0_heap_set_limit(bytes);
+  c0_heap_use(prev);
+}
+
+void c0_vm_heap_stats(c0_vm *vm, struct c0_heap_stats *stats) {
+  REQUIRES(vm != NULL && stats != NULL);
+  struct c0_heap *prev = c0_heap_use(vm->heap);
+  c0_heap_stats(stats);
+  c0_heap_use(prev);
+}
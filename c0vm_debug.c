@@ -0,0 +1,108 @@
+/* C0VM debug info
+ * Recovers function and native names from the comments cc0 leaves in
+ * a .bc0 file. Only used for reports, so anything unexpected just
+ * leaves a name out.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm_debug.h"
+#include "lib/c0vm_loader.h"
+
+static void append(char ***names, uint16_t *count, size_t *cap, char *name) {
+  if (*count == UINT16_MAX) return;
+  if (*count == *cap) {
+    *cap = *cap == 0 ? 16 : 2 * *cap;
+    char **bigger = xcalloc(*cap, sizeof *bigger);
+    if (*names != NULL) memcpy(bigger, *names, *count * sizeof *bigger);
+    free(*names);
+    *names = bigger;
+  }
+  (*names)[(*count)++] = name;
+}
+
+static char *copy_trimmed(const char *start, const char *end) {
+  while (start < end && (*start == ' ' || *start == '\t')) start++;
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t'
+                         || end[-1] == '\n' || end[-1] == '\r')) end--;
+  char *s = xmalloc(end - start + 1);
+  memcpy(s, start, end - start);
+  s[end - start] = '\0';
+  return s;
+}
+
+struct c0_debug_info *c0_debug_load(const char *filename) {
+  struct c0_debug_info *dbg = xcalloc(1, sizeof *dbg);
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) return dbg;
+
+  // Images carry no comments
+  char magic[8];
+  if (fread(magic, 1, sizeof magic, f) == sizeof magic
+      && memcmp(magic, C0_IMAGE_MAGIC, sizeof magic) == 0) {
+    fclose(f);
+    return dbg;
+  }
+  rewind(f);
+
+  size_t fn_cap = 0, native_cap = 0;
+  bool in_native_pool = false;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t n;
+  while ((n = getline(&line, &line_cap, f)) > 0) {
+    char *end = line + n;
+    if (line[0] == '#' && line[1] == '<') {
+      char *close = strchr(line, '>');
+      if (close != NULL) {
+        append(&dbg->function_names, &dbg->function_count, &fn_cap,
+               copy_trimmed(line + 2, close));
+      }
+    } else if (strstr(line, "# native pool") == line) {
+      in_native_pool = true;
+    } else if (in_native_pool && line[0] != '#') {
+      char *hash = strchr(line, '#');
+      if (hash != NULL) {
+        append(&dbg->native_names, &dbg->native_count, &native_cap,
+               copy_trimmed(hash + 1, end));
+      }
+    }
+  }
+
+  free(line);
+  fclose(f);
+  return dbg;
+}
+
+void c0_debug_free(struct c0_debug_info *dbg) {
+  if (dbg == NULL) return;
+  for (uint16_t i = 0; i < dbg->function_count; i++)
+    free(dbg->function_names[i]);
+  for (uint16_t i = 0; i < dbg->native_count; i++)
+    free(dbg->native_names[i]);
+  free(dbg->function_names);
+  free(dbg->native_names);
+  free(dbg);
+}
+
+const char *c0_function_name(struct c0_debug_info *dbg, uint16_t idx,
+                             char *buf, size_t len) {
+  if (dbg != NULL && idx < dbg->function_count
+      && dbg->function_names[idx] != NULL)
+    return dbg->function_names[idx];
+  snprintf(buf, len, "fn#%u", (unsigned) idx);
+  return buf;
+}
+
+const char *c0_native_name(struct c0_debug_info *dbg, uint16_t idx,
+                           char *buf, size_t len) {
+  if (dbg != NULL && idx < dbg->native_count
+      && dbg->native_names[idx] != NULL)
+    return dbg->native_names[idx];
+  snprintf(buf, len, "native#%u", (unsigned) idx);
+  return buf;
+}
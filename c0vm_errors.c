@@ -0,0 +1,63 @@
+/* C0VM runtime errors
+ * Link-time wrappers around lib/c0vm_abort.h, see lib/c0vm_errors.h.
+ */
+#include <stdio.h>
+#include <stddef.h>
+
+#include "lib/c0vm_abort.h"
+#include "lib/c0vm_errors.h"
+#include "lib/c0vm_output.h"
+#include "lib/c0vm_probes.h"
+#include "lib/c0vm_recorder.h"
+
+void __real_c0_user_error(char *err);
+void __real_c0_assertion_failure(char *err);
+void __real_c0_memory_error(char *err);
+void __real_c0_value_error(char *err);
+void __real_c0_arith_error(char *err);
+
+static __thread struct c0_trap *trap = NULL;
+
+struct c0_trap *c0_set_trap(struct c0_trap *t) {
+  struct c0_trap *prev = trap;
+  trap = t;
+  return prev;
+}
+
+/* Everything the VM wants to do before the error is reported */
+static void on_error(enum c0_error_kind kind, char *err) {
+  C0VM_PROBE2(error, kind, err);
+  if (trap != NULL) {
+    trap->kind = kind;
+    snprintf(trap->message, sizeof trap->message, "%s",
+             err == NULL ? "" : err);
+    longjmp(trap->env, 1);
+  }
+  c0_output_flush();
+  c0_recorder_dump_on_error();
+}
+
+void __wrap_c0_user_error(char *err) {
+  on_error(C0_ERROR_USER, err);
+  __real_c0_user_error(err);
+}
+
+void __wrap_c0_assertion_failure(char *err) {
+  on_error(C0_ERROR_ASSERTION, err);
+  __real_c0_assertion_failure(err);
+}
+
+void __wrap_c0_memory_error(char *err) {
+  on_error(C0_ERROR_MEMORY, err);
+  __real_c0_memory_error(err);
+}
+
+void __wrap_c0_value_error(char *err) {
+  on_error(C0_ERROR_VALUE, err);
+  __real_c0_value_error(err);
+}
+
+void __wrap_c0_arith_error(char *err) {
+  on_error(C0_ERROR_ARITH, err);
+  __real_c0_arith_error(err);
+}
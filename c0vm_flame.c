@@ -0,0 +1,155 @@
+/* C0VM call-graph timing
+ * Call paths form a tree: each node is one function reached through one
+ * particular chain of callers. The shadow stack holds the open nodes
+ * with their entry time and the time spent in their children so far.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_flame.h"
+
+#define NATIVE_BIT 0x10000   // node keys are fn, or native | NATIVE_BIT
+#define NO_NODE (-1)
+
+typedef struct {
+  uint32_t key;
+  int32_t parent, first_child, next_sibling;
+  uint64_t calls;
+  uint64_t inclusive_ns;
+  uint64_t exclusive_ns;
+} node;
+
+typedef struct {
+  int32_t node;
+  uint64_t start_ns;
+  uint64_t children_ns;
+} open_frame;
+
+bool c0_flame_enabled = false;
+
+static node *nodes = NULL;
+static size_t node_count = 0, node_cap = 0;
+static open_frame *stack = NULL;
+static size_t depth = 0, stack_cap = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int32_t new_node(uint32_t key, int32_t parent) {
+  if (node_count == node_cap) {
+    node_cap = node_cap == 0 ? 256 : 2 * node_cap;
+    node *bigger = xcalloc(node_cap, sizeof *bigger);
+    if (nodes != NULL) memcpy(bigger, nodes, node_count * sizeof *nodes);
+    free(nodes);
+    nodes = bigger;
+  }
+  int32_t n = (int32_t) node_count++;
+  nodes[n].key = key;
+  nodes[n].parent = parent;
+  nodes[n].first_child = NO_NODE;
+  nodes[n].next_sibling = NO_NODE;
+  if (parent != NO_NODE) {
+    nodes[n].next_sibling = nodes[parent].first_child;
+    nodes[parent].first_child = n;
+  }
+  return n;
+}
+
+static int32_t child(int32_t parent, uint32_t key) {
+  if (parent == NO_NODE) {
+    for (size_t i = 0; i < node_count; i++)
+      if (nodes[i].parent == NO_NODE && nodes[i].key == key)
+        return (int32_t) i;
+    return new_node(key, NO_NODE);
+  }
+  for (int32_t c = nodes[parent].first_child; c != NO_NODE;
+       c = nodes[c].next_sibling) {
+    if (nodes[c].key == key) return c;
+  }
+  return new_node(key, parent);
+}
+
+static void enter(uint32_t key) {
+  if (depth == stack_cap) {
+    stack_cap = stack_cap == 0 ? 64 : 2 * stack_cap;
+    open_frame *bigger = xcalloc(stack_cap, sizeof *bigger);
+    if (stack != NULL) memcpy(bigger, stack, depth * sizeof *stack);
+    free(stack);
+    stack = bigger;
+  }
+  int32_t parent = depth == 0 ? NO_NODE : stack[depth - 1].node;
+  open_frame *f = &stack[depth++];
+  f->node = child(parent, key);
+  f->children_ns = 0;
+  nodes[f->node].calls++;
+  f->start_ns = now_ns();
+}
+
+void c0_flame_enter(uint16_t fn) {
+  enter(fn);
+}
+
+void c0_flame_enter_native(uint16_t native) {
+  enter((uint32_t)native | NATIVE_BIT);
+}
+
+static void exit_at(uint64_t t) {
+  REQUIRES(depth > 0);
+  open_frame *f = &stack[--depth];
+  uint64_t elapsed = t - f->start_ns;
+  nodes[f->node].inclusive_ns += elapsed;
+  nodes[f->node].exclusive_ns += elapsed - f->children_ns;
+  if (depth > 0) stack[depth - 1].children_ns += elapsed;
+}
+
+void c0_flame_exit(void) {
+  exit_at(now_ns());
+}
+
+static void frame_name(uint32_t key, struct c0_debug_info *dbg,
+                       char *out, size_t len) {
+  char buf[32];
+  if (key & NATIVE_BIT) {
+    snprintf(out, len, "native:%s",
+             c0_native_name(dbg, key & 0xFFFF, buf, sizeof buf));
+  } else {
+    snprintf(out, len, "%s", c0_function_name(dbg, key, buf, sizeof buf));
+  }
+}
+
+static void print_path(FILE *out, int32_t n, struct c0_debug_info *dbg) {
+  char name[128];
+  if (nodes[n].parent != NO_NODE) {
+    print_path(out, nodes[n].parent, dbg);
+    fputc(';', out);
+  }
+  frame_name(nodes[n].key, dbg, name, sizeof name);
+  fputs(name, out);
+}
+
+void c0_flame_report(FILE *out, struct c0_debug_info *dbg) {
+  uint64_t t = now_ns();
+  while (depth > 0) exit_at(t);
+
+  for (size_t i = 0; i < node_count; i++) {
+    if (nodes[i].exclusive_ns == 0) continue;
+    print_path(out, (int32_t) i, dbg);
+    fprintf(out, " %" PRIu64 "\n", nodes[i].exclusive_ns);
+  }
+}
+
+void c0_flame_free(void) {
+  free(nodes);
+  free(stack);
+  nodes = NULL;
+  stack = NULL;
+  node_count = node_cap = depth = stack_cap = 0;
+}
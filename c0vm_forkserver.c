@@ -0,0 +1,113 @@
+/* C0VM fork server
+ * The snapshot is taken from inside the native call: a trampoline in
+ * native_function_table accepts connections on the first call and
+ * only returns in the forked children, which then make the real call
+ * and carry on with main as usual. The parent never returns to the
+ * VM. Children are reaped by ignoring SIGCHLD.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_debug.h"
+#include "lib/c0vm_forkserver.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_output.h"
+#include "lib/c0vm_serve.h"
+
+static native_fn *target = NULL;     // the native the trampoline stands for
+static bool forked = false;          // in a job
+static int listen_fd = -1;
+static const char *socket_file = NULL;
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+/* Returns in a new job, with conn as its stdin, stdout and stderr */
+static void start_job(int conn) {
+  forked = true;
+  close(listen_fd);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  dup2(conn, STDIN_FILENO);
+  dup2(conn, STDOUT_FILENO);
+  dup2(conn, STDERR_FILENO);
+  if (conn > STDERR_FILENO) close(conn);
+}
+
+static void serve_forks(void) {
+  // Whatever the program printed so far belongs to the server
+  c0_output_flush();
+  fflush(stdout);
+  fflush(stderr);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGCHLD, SIG_IGN);
+  while (!stopping) {
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      start_job(conn);
+      return;
+    }
+    if (pid < 0) perror("fork");
+    close(conn);
+  }
+  close(listen_fd);
+  unlink(socket_file);
+  exit(stopping ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static c0_value snapshot(c0_value *args) {
+  if (!forked) serve_forks();
+  return (*target)(args);
+}
+
+/* The native function table index of the native named at, or -1 */
+static int find_native(struct bc0_file *bc0, const char *filename,
+                       const char *at) {
+  struct c0_debug_info *dbg = c0_debug_load(filename);
+  int index = -1;
+  for (uint16_t i = 0; i < bc0->native_count && i < dbg->native_count; i++) {
+    if (dbg->native_names[i] != NULL && strcmp(dbg->native_names[i], at) == 0)
+      index = bc0->native_pool[i].function_table_index;
+  }
+  c0_debug_free(dbg);
+  return index;
+}
+
+bool c0_fork_server_init(struct bc0_file *bc0, const char *filename,
+                         const char *at, const char *socket_path) {
+  int index = find_native(bc0, filename, at);
+  if (index < 0) {
+    fprintf(stderr, "c0vm: %s does not call a native named %s\n", filename,
+            at);
+    return false;
+  }
+  listen_fd = c0_serve_listen(socket_path);
+  if (listen_fd < 0) return false;
+  socket_file = socket_path;
+  native_fn **table = c0_natives_table();
+  target = table[index];
+  table[index] = snapshot;
+  return true;
+}
@@ -0,0 +1,358 @@
+/* C0VM heap
+ * Large arrays are served from anonymous mappings: the kernel hands out
+ * zero pages lazily, so alloc_array(int, 100000000) costs nothing until
+ * the elements are touched, and the memory goes straight back to the
+ * OS when the heap is released or reset. C0 has no free, so arrays are
+ * not given back one at a time.
+ */
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_abort.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_heap.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+struct c0_heap_options c0_heap_options = {
+  .mmap_threshold = HUGE_PAGE_SIZE,
+  .hugepages = C0_HUGEPAGES_MADVISE,
+  .track = false,
+  .limit = 0,
+};
+
+/* Live large mappings, so they can be found again on release */
+typedef struct mapping mapping;
+struct mapping {
+  void *base;
+  size_t len;
+  size_t bytes;               // asked for, len rounded up
+  mapping *next;
+};
+
+struct blocks {
+  struct c0_heap_block *at;
+  size_t count;
+  size_t capacity;
+};
+
+struct c0_heap {
+  mapping *mappings;
+  /* When tracking, every other allocation since the last reset, and
+   * what natives returned: boxed results that only the native can
+   * have allocated, and strings and arrays, which may be a literal or
+   * share storage with an argument and so are not ours to free */
+  struct blocks tracked;
+  struct blocks adopted;
+  struct blocks foreign;
+  size_t limit;               // the process heap uses c0_heap_options'
+  struct c0_heap_stats stats;
+};
+
+/* The heap execute() uses unless a thread has switched to another */
+static struct c0_heap process_heap;
+static __thread struct c0_heap *current = NULL;
+
+static struct c0_heap *heap(void) {
+  return current == NULL ? &process_heap : current;
+}
+
+/* Heaps from c0_heap_new always track */
+static bool tracking(struct c0_heap *h) {
+  return h != &process_heap || c0_heap_options.track;
+}
+
+static void add_block(struct blocks *b, void *p, size_t bytes) {
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity == 0 ? 1024 : 2 * b->capacity;
+    struct c0_heap_block *grown = xcalloc(b->capacity, sizeof *grown);
+    if (b->count > 0) memcpy(grown, b->at, b->count * sizeof *grown);
+    free(b->at);
+    b->at = grown;
+  }
+  b->at[b->count].base = p;
+  b->at[b->count].bytes = bytes;
+  b->count++;
+}
+
+static void clear_blocks(struct blocks *b) {
+  free(b->at);
+  b->at = NULL;
+  b->count = b->capacity = 0;
+}
+
+static void *track(void *p, size_t bytes) {
+  struct c0_heap *h = heap();
+  if (tracking(h)) add_block(&h->tracked, p, bytes);
+  return p;
+}
+
+static size_t limit_of(struct c0_heap *h) {
+  return h == &process_heap ? c0_heap_options.limit : h->limit;
+}
+
+void c0_heap_charge(size_t bytes) {
+  struct c0_heap *h = heap();
+  size_t limit = limit_of(h), live = h->stats.live;
+  if (limit != 0 && (live > limit || bytes > limit - live)) {
+    static __thread char message[128];
+    snprintf(message, sizeof message, "out of memory: %zu more bytes"
+             " would go over the heap limit of %zu", bytes, limit);
+    c0_memory_error(message);
+  }
+  h->stats.live += bytes;
+  if (h->stats.live > h->stats.peak) h->stats.peak = h->stats.live;
+  h->stats.allocated += bytes;
+  h->stats.allocations++;
+}
+
+void c0_heap_uncharge(size_t bytes) {
+  struct c0_heap *h = heap();
+  h->stats.live = bytes < h->stats.live ? h->stats.live - bytes : 0;
+}
+
+void c0_heap_set_limit(size_t bytes) {
+  struct c0_heap *h = heap();
+  if (h == &process_heap) c0_heap_options.limit = bytes;
+  else h->limit = bytes;
+}
+
+void c0_heap_stats(struct c0_heap_stats *stats) {
+  struct c0_heap *h = heap();
+  *stats = h->stats;
+  stats->limit = limit_of(h);
+}
+
+/* Zeroed memory, or a C0 memory error instead of aborting */
+static void *zalloc(size_t n, size_t s) {
+  void *p = calloc(n, s);
+  if (p == NULL && n != 0 && s != 0) c0_memory_error("out of memory");
+  return p;
+}
+
+bool c0_parse_hugepage_policy(const char *s, enum c0_hugepage_policy *out) {
+  if (strcmp(s, "never") == 0) {
+    *out = C0_HUGEPAGES_NEVER;
+    return true;
+  }
+  if (strcmp(s, "madvise") == 0) {
+    *out = C0_HUGEPAGES_MADVISE;
+    return true;
+  }
+  return false;
+}
+
+static bool use_mmap(size_t bytes) {
+  return c0_heap_options.mmap_threshold != 0
+      && bytes >= c0_heap_options.mmap_threshold;
+}
+
+static size_t round_up(size_t x, size_t align) {
+  return (x + align - 1) & ~(align - 1);
+}
+
+static void *map_region(size_t len) {
+  bool huge = c0_heap_options.hugepages == C0_HUGEPAGES_MADVISE;
+
+  // Over-allocate by one huge page so the region can start on a
+  // huge page boundary, then trim the slack on either side.
+  size_t span = huge ? len + HUGE_PAGE_SIZE : len;
+  void *p = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) c0_memory_error("out of memory");
+  if (!huge) return p;
+
+  uintptr_t start = (uintptr_t)p;
+  uintptr_t aligned = round_up(start, HUGE_PAGE_SIZE);
+  if (aligned > start) munmap(p, aligned - start);
+  size_t tail = (start + span) - (aligned + len);
+  if (tail > 0) munmap((void *)(aligned + len), tail);
+
+  madvise((void *)aligned, len, MADV_HUGEPAGE);
+  return (void *)aligned;
+}
+
+void *c0_object_alloc(size_t bytes) {
+  c0_heap_charge(bytes);
+  return track(zalloc(1, bytes == 0 ? 1 : bytes), bytes);
+}
+
+void *c0_array_alloc(size_t n, size_t s) {
+  size_t bytes = n * s;
+  c0_heap_charge(bytes);
+  if (!use_mmap(bytes)) return track(zalloc(n, s), bytes);
+
+  size_t len = round_up(bytes, c0_heap_options.hugepages == C0_HUGEPAGES_MADVISE
+                               ? HUGE_PAGE_SIZE : (size_t)4096);
+  struct c0_heap *h = heap();
+  void *base = map_region(len);
+  mapping *m = xmalloc(sizeof *m);
+  m->base = base;
+  m->len = len;
+  m->bytes = bytes;
+  m->next = h->mappings;
+  h->mappings = m;
+  return m->base;
+}
+
+static size_t array_size(c0_array *arr) {
+  if (arr == NULL) return 0;
+  return sizeof *arr + (size_t)arr->count * arr->elt_size;
+}
+
+size_t c0_native_alloc_size(uint16_t table_index, c0_value result) {
+  if (result.kind != C0_POINTER) return 0;
+  void *p = result.payload.p;
+  if (p == NULL) return 0;
+
+  switch (table_index) {
+    case NATIVE_READLINE:
+    case NATIVE_FILE_READLINE:
+    case NATIVE_STRING_FROM_CHARARRAY:
+    case NATIVE_STRING_FROMBOOL:
+    case NATIVE_STRING_FROMCHAR:
+    case NATIVE_STRING_FROMINT:
+    case NATIVE_STRING_JOIN:
+    case NATIVE_STRING_SUB:
+    case NATIVE_STRING_TOLOWER:
+      return strlen((char *) p) + 1;
+
+    case NATIVE_STRING_TO_CHARARRAY:
+    case NATIVE_PARSE_INTS:
+    case NATIVE_PARSE_TOKENS:
+      return array_size((c0_array *) p);
+
+    case NATIVE_PARSE_BOOL:
+    case NATIVE_PARSE_INT:
+      return sizeof(int32_t);
+
+    case NATIVE_DADD:
+    case NATIVE_DDIV:
+    case NATIVE_DMUL:
+    case NATIVE_DSUB:
+    case NATIVE_ITOD:
+      return sizeof(double);
+
+    default:
+      return 0;
+  }
+}
+
+/* Natives whose result is a fresh malloc'ed box of their own */
+static bool boxes_result(uint16_t table_index) {
+  switch (table_index) {
+    case NATIVE_PARSE_BOOL:
+    case NATIVE_PARSE_INT:
+    case NATIVE_DADD:
+    case NATIVE_DDIV:
+    case NATIVE_DMUL:
+    case NATIVE_DSUB:
+    case NATIVE_ITOD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void record_native_result(struct c0_heap *h, uint16_t table_index,
+                                 void *p, size_t bytes) {
+  switch (table_index) {
+    case NATIVE_STRING_TO_CHARARRAY:
+    case NATIVE_PARSE_INTS:
+    case NATIVE_PARSE_TOKENS: {
+      c0_array *arr = p;
+      add_block(&h->foreign, arr, sizeof *arr);
+      add_block(&h->foreign, arr->elems, bytes - sizeof *arr);
+      if (table_index != NATIVE_PARSE_TOKENS) break;
+      for (uint32_t i = 0; i < arr->count; i++) {
+        char *token = ((char **) arr->elems)[i];
+        add_block(&h->foreign, token, strlen(token) + 1);
+      }
+      break;
+    }
+    default:
+      add_block(boxes_result(table_index) ? &h->adopted : &h->foreign, p,
+                bytes);
+  }
+}
+
+size_t c0_heap_native_result(uint16_t table_index, c0_value result) {
+  size_t bytes = c0_native_alloc_size(table_index, result);
+  if (bytes == 0) return 0;
+  struct c0_heap *h = heap();
+  // Recorded before the charge, which may raise a memory error: the
+  // reset after it then still frees the result
+  if (tracking(h))
+    record_native_result(h, table_index, result.payload.p, bytes);
+  c0_heap_charge(bytes);
+  return bytes;
+}
+
+struct c0_heap_block *c0_heap_blocks(size_t *count) {
+  struct c0_heap *h = heap();
+  REQUIRES(tracking(h));
+  struct blocks *lists[] = { &h->tracked, &h->adopted, &h->foreign };
+  size_t n = 0;
+  for (size_t k = 0; k < 3; k++) n += lists[k]->count;
+  for (mapping *m = h->mappings; m != NULL; m = m->next) n++;
+  struct c0_heap_block *all = xcalloc(n + 1, sizeof *all);
+  size_t i = 0;
+  for (size_t k = 0; k < 3; k++) {
+    if (lists[k]->count > 0)
+      memcpy(all + i, lists[k]->at, lists[k]->count * sizeof *all);
+    i += lists[k]->count;
+  }
+  for (mapping *m = h->mappings; m != NULL; m = m->next, i++) {
+    all[i].base = m->base;
+    all[i].bytes = m->bytes;
+  }
+  *count = n;
+  return all;
+}
+
+void c0_heap_release(void) {
+  struct c0_heap *h = heap();
+  while (h->mappings != NULL) {
+    mapping *m = h->mappings;
+    munmap(m->base, m->len);
+    h->mappings = m->next;
+    free(m);
+  }
+}
+
+void c0_heap_reset(void) {
+  struct c0_heap *h = heap();
+  for (size_t i = 0; i < h->tracked.count; i++) free(h->tracked.at[i].base);
+  clear_blocks(&h->tracked);
+  for (size_t i = 0; i < h->adopted.count; i++) free(h->adopted.at[i].base);
+  clear_blocks(&h->adopted);
+  clear_blocks(&h->foreign);
+  h->stats.live = 0;
+  c0_heap_release();
+}
+
+struct c0_heap *c0_heap_new(void) {
+  struct c0_heap *h = xcalloc(1, sizeof(struct c0_heap));
+  h->limit = c0_heap_options.limit;
+  return h;
+}
+
+struct c0_heap *c0_heap_use(struct c0_heap *h) {
+  struct c0_heap *prev = current;
+  current = h;
+  return prev;
+}
+
+void c0_heap_free(struct c0_heap *h) {
+  if (h == NULL) return;
+  REQUIRES(h != current);
+  struct c0_heap *prev = c0_heap_use(h);
+  c0_heap_reset();
+  c0_heap_use(prev);
+  free(h);
+}
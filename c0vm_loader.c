@@ -0,0 +1,593 @@
+/* C0VM program loader
+ * Both inputs end up as an image block: text is decoded once into a
+ * malloc'd block laid out like an image file, image files are mapped.
+ * attach() then only has to check the header and point the bc0_file
+ * fields into the block; the function pool is the one table it builds,
+ * since function_info holds pointers.
+ *
+ * Function bodies of a text file that is not going into the cache are
+ * left undecoded (their function_info.code is NULL) and the text stays
+ * mapped; execute() calls c0_load_function on first INVOKESTATIC. The
+ * first pass still walks every body to find where the next one
+ * starts, so malformed code is reported at load time either way.
+ *
+ * The cache stores exactly those decoded blocks. An entry is named
+ * <source hash>-<build id>.img and is written to a temporary file and
+ * renamed into place, so concurrent runs never see half an image.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_abort.h"
+#include "lib/c0vm_loader.h"
+
+#define BC0_MAGIC 0xc0c0ffee
+
+struct c0_loader_options c0_loader_options = {
+  .cache = true,
+  .cache_dir = NULL,
+};
+
+struct loaded {
+  struct bc0_file bc0;   // first, so a program is also a struct loaded
+  void *block;
+  size_t size;
+  bool mapped;
+
+  // Only while function bodies are still undecoded
+  const char *text;      // the mapped .bc0 file
+  size_t text_len;
+  size_t *code_at;       // text offset of each function body
+  char *filename;
+};
+
+static void load_error(const char *filename, const char *msg) {
+  fprintf(stderr, "c0vm: %s: %s\n", filename, msg);
+}
+
+static size_t align8(size_t x) {
+  return (x + 7) & ~(size_t)7;
+}
+
+static bool check_bc0(uint32_t magic, uint16_t version, const char *filename) {
+  if (magic != BC0_MAGIC) {
+    load_error(filename, "not a bc0 file (bad magic number)");
+    return false;
+  }
+  if (version >> 1 != BYTECODE_VERSION) {
+    load_error(filename, "bytecode version mismatch, recompile with cc0 -b");
+    return false;
+  }
+  if ((version & 1) != (sizeof(void *) == 8)) {
+    load_error(filename, "bytecode compiled for a different word size");
+    return false;
+  }
+  return true;
+}
+
+
+// FNV-1a style, but eight bytes per step: text files can be large and
+// the hash is all a cache hit pays for
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+  const ubyte *p = data;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+uint64_t c0_build_id(void) {
+  static const char build[] = __DATE__ " " __TIME__;
+  uint32_t config[3] = { C0_IMAGE_FORMAT, BYTECODE_VERSION, sizeof(void *) };
+  uint64_t h = hash_bytes(HASH_SEED, build, sizeof build);
+  return hash_bytes(h, config, sizeof config);
+}
+
+
+/*** .bc0 text ***/
+
+static int hex_digit(char c) {
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('a' <= c && c <= 'f') return c - 'a' + 10;
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Hex byte pairs separated by whitespace, '#' comments to end of line
+typedef struct {
+  const char *text;
+  size_t len;
+  size_t pos;
+  bool ok;          // false once truncated or malformed
+  bool malformed;
+} reader;
+
+static int rd_byte(reader *r) {
+  while (r->pos < r->len) {
+    char c = r->text[r->pos];
+    if (c == '#') {
+      while (r->pos < r->len && r->text[r->pos] != '\n') r->pos++;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      r->pos++;
+    } else {
+      break;
+    }
+  }
+  if (!r->ok || r->len - r->pos < 2) {
+    r->ok = false;
+    return 0;
+  }
+  int hi = hex_digit(r->text[r->pos]);
+  int lo = hex_digit(r->text[r->pos + 1]);
+  if (hi < 0 || lo < 0) {
+    r->ok = false;
+    r->malformed = true;
+    return 0;
+  }
+  r->pos += 2;
+  return hi << 4 | lo;
+}
+
+// Reads a big-endian field of 1, 2 or 4 bytes
+static uint32_t rd(reader *r, unsigned bytes) {
+  uint32_t x = 0;
+  for (unsigned i = 0; i < bytes; i++) x = x << 8 | rd_byte(r);
+  return x;
+}
+
+// Decodes n bytes into out, or skips them if out is NULL. This is the
+// loop that runs over every function body, so it is rd_byte inlined.
+static void rd_bytes(reader *r, ubyte *out, size_t n) {
+  const char *t = r->text;
+  size_t pos = r->pos;
+  size_t i = 0;
+  while (i < n && pos < r->len && r->ok) {
+    char c = t[pos];
+    if (c == '#') {
+      const char *nl = memchr(t + pos, '\n', r->len - pos);
+      pos = nl == NULL ? r->len : (size_t)(nl - t);
+      continue;
+    }
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      pos++;
+      continue;
+    }
+    int hi = hex_digit(c);
+    int lo = r->len - pos >= 2 ? hex_digit(t[pos + 1]) : -1;
+    if (hi < 0 || lo < 0) break;
+    if (out != NULL) out[i] = (ubyte)(hi << 4 | lo);
+    pos += 2;
+    i++;
+  }
+  r->pos = pos;
+  if (i < n) rd_byte(r);   // sets ok and malformed
+}
+
+static bool reader_ok(reader *r, const char *filename) {
+  if (!r->ok) {
+    load_error(filename, r->malformed ? "malformed bytecode (expected hex bytes)"
+                                      : "truncated bytecode");
+  }
+  return r->ok;
+}
+
+// Lays the text out as an image in one new block. Function bodies are
+// decoded only if eager; either way code_at[i] is set to the text
+// offset of function i's body, for c0_load_function.
+static void *build_image(const char *text, size_t len, bool eager,
+                         size_t *size, size_t **code_at, const char *filename) {
+  struct c0_image_header h;
+  memset(&h, 0, sizeof h);
+  reader r = { text, len, 0, true, false };
+
+  h.bc0_magic = rd(&r, 4);
+  h.bc0_version = rd(&r, 2);
+  if (!reader_ok(&r, filename)) return NULL;
+  if (!check_bc0(h.bc0_magic, h.bc0_version, filename)) return NULL;
+
+  h.int_count = rd(&r, 2);
+  size_t ints_at = r.pos;
+  rd_bytes(&r, NULL, 4 * (size_t) h.int_count);
+  h.string_count = rd(&r, 2);
+  size_t strings_at = r.pos;
+  rd_bytes(&r, NULL, h.string_count);
+  h.function_count = rd(&r, 2);
+  struct c0_image_fn *fn_info = xcalloc(h.function_count + 1, sizeof *fn_info);
+  size_t *body_at = xcalloc(h.function_count + 1, sizeof *body_at);
+  size_t code_size = 0;
+  for (uint16_t i = 0; i < h.function_count && r.ok; i++) {
+    fn_info[i].num_args = rd(&r, 1);
+    fn_info[i].num_vars = rd(&r, 1);
+    fn_info[i].code_length = rd(&r, 2);
+    fn_info[i].code_offset = code_size;
+    body_at[i] = r.pos;
+    rd_bytes(&r, NULL, fn_info[i].code_length);
+    code_size += fn_info[i].code_length;
+  }
+  h.native_count = rd(&r, 2);
+  size_t natives_at = r.pos;
+  rd_bytes(&r, NULL, 4 * (size_t) h.native_count);
+  bool ok = reader_ok(&r, filename);
+  if (ok && h.function_count == 0) {
+    load_error(filename, "no main function");
+    ok = false;
+  }
+  if (!ok) {
+    free(fn_info);
+    free(body_at);
+    return NULL;
+  }
+
+  memcpy(h.magic, C0_IMAGE_MAGIC, sizeof h.magic);
+  h.format = C0_IMAGE_FORMAT;
+  h.byte_order = C0_IMAGE_BYTE_ORDER;
+  h.int_offset = align8(sizeof h);
+  h.native_offset = align8(h.int_offset + 4 * (size_t) h.int_count);
+  h.function_offset = align8(h.native_offset
+                             + h.native_count * sizeof(struct native_info));
+  h.string_offset = align8(h.function_offset
+                           + h.function_count * sizeof(struct c0_image_fn));
+  h.code_offset = align8(h.string_offset + h.string_count);
+  h.size = h.code_offset + code_size;
+
+  char *block = xcalloc(h.size, 1);
+  memcpy(block, &h, sizeof h);
+
+  r.pos = ints_at;
+  int32_t *ints = (int32_t *)(block + h.int_offset);
+  for (uint16_t i = 0; i < h.int_count; i++) ints[i] = (int32_t) rd(&r, 4);
+
+  r.pos = strings_at;
+  rd_bytes(&r, (ubyte *)(block + h.string_offset), h.string_count);
+  if (h.string_count > 0 && block[h.string_offset + h.string_count - 1] != '\0') {
+    load_error(filename, "string pool is not NUL-terminated");
+    free(fn_info);
+    free(body_at);
+    free(block);
+    return NULL;
+  }
+
+  memcpy(block + h.function_offset, fn_info,
+         h.function_count * sizeof(struct c0_image_fn));
+  for (uint16_t i = 0; i < (eager ? h.function_count : 1); i++) {
+    r.pos = body_at[i];
+    rd_bytes(&r, (ubyte *)(block + h.code_offset + fn_info[i].code_offset),
+             fn_info[i].code_length);
+  }
+  free(fn_info);
+
+  r.pos = natives_at;
+  struct native_info *natives = (struct native_info *)(block + h.native_offset);
+  for (uint16_t i = 0; i < h.native_count; i++) {
+    natives[i].num_args = rd(&r, 2);
+    natives[i].function_table_index = rd(&r, 2);
+  }
+
+  *size = h.size;
+  *code_at = body_at;
+  return block;
+}
+
+
+/*** images ***/
+
+static bool is_image(const void *data, size_t size) {
+  return size >= sizeof(struct c0_image_header)
+      && memcmp(data, C0_IMAGE_MAGIC, 8) == 0;
+}
+
+static bool section_ok(uint64_t offset, uint64_t len, uint64_t size) {
+  return offset % 8 == 0 && offset <= size && len <= size - offset;
+}
+
+// Points a new bc0_file into block; takes ownership of block
+static struct bc0_file *attach(void *block, size_t size, bool mapped,
+                               const char *filename) {
+  char *base = block;
+  struct c0_image_header *h = block;
+  bool ok = h->format == C0_IMAGE_FORMAT
+         && h->byte_order == C0_IMAGE_BYTE_ORDER
+         && h->size == size
+         && section_ok(h->int_offset, 4 * (uint64_t) h->int_count, size)
+         && section_ok(h->native_offset,
+                       h->native_count * sizeof(struct native_info), size)
+         && section_ok(h->function_offset,
+                       h->function_count * sizeof(struct c0_image_fn), size)
+         && section_ok(h->string_offset, h->string_count, size)
+         && section_ok(h->code_offset, 0, size)
+         && h->function_count > 0
+         && (h->string_count == 0
+             || base[h->string_offset + h->string_count - 1] == '\0');
+  if (!ok) load_error(filename, "corrupt or incompatible program image");
+  ok = ok && check_bc0(h->bc0_magic, h->bc0_version, filename);
+
+  struct c0_image_fn *fns = ok ? (struct c0_image_fn *)(base + h->function_offset)
+                               : NULL;
+  for (uint16_t i = 0; ok && i < h->function_count; i++) {
+    if ((uint64_t) fns[i].code_offset + fns[i].code_length
+        > size - h->code_offset) {
+      load_error(filename, "corrupt program image (code out of bounds)");
+      ok = false;
+    }
+  }
+  if (!ok) {
+    if (mapped) munmap(block, size);
+    else free(block);
+    return NULL;
+  }
+
+  struct loaded *l = xcalloc(1, sizeof *l);
+  l->block = block;
+  l->size = size;
+  l->mapped = mapped;
+
+  struct bc0_file *bc0 = &l->bc0;
+  bc0->magic = h->bc0_magic;
+  bc0->version = h->bc0_version;
+  bc0->int_count = h->int_count;
+  bc0->int_pool = (int32_t *)(base + h->int_offset);
+  bc0->string_count = h->string_count;
+  bc0->string_pool = base + h->string_offset;
+  bc0->native_count = h->native_count;
+  bc0->native_pool = (struct native_info *)(base + h->native_offset);
+  bc0->function_count = h->function_count;
+  bc0->function_pool = xcalloc(h->function_count, sizeof(struct function_info));
+  for (uint16_t i = 0; i < h->function_count; i++) {
+    struct function_info *f = &bc0->function_pool[i];
+    f->num_args = fns[i].num_args;
+    f->num_vars = fns[i].num_vars;
+    f->code_length = fns[i].code_length;
+    f->code = (ubyte *)(base + h->code_offset + fns[i].code_offset);
+  }
+  return bc0;
+}
+
+
+// Maps a whole file read-only; NULL if it is missing or empty
+static void *map_file(const char *filename, size_t *len, bool quiet) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    if (!quiet) perror(filename);
+    return NULL;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) != 0) {
+    if (!quiet) perror(filename);
+  } else if (st.st_size == 0) {
+    if (!quiet) load_error(filename, "empty file");
+  } else {
+    *len = (size_t) st.st_size;
+    data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED && !quiet) perror(filename);
+  }
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+
+/*** cache ***/
+
+static const char *cache_dir(void) {
+  static char dir[4096];
+  if (c0_loader_options.cache_dir != NULL) return c0_loader_options.cache_dir;
+
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (xdg != NULL && xdg[0] != '\0') {
+    mkdir(xdg, 0700);
+    n = snprintf(dir, sizeof dir, "%s/c0vm", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    n = snprintf(dir, sizeof dir, "%s/.cache", home);
+    if (n > 0 && (size_t) n < sizeof dir) mkdir(dir, 0700);
+    n = snprintf(dir, sizeof dir, "%s/.cache/c0vm", home);
+  } else {
+    return NULL;
+  }
+  return n > 0 && (size_t) n < sizeof dir ? dir : NULL;
+}
+
+// Cache entry for text with this hash, or NULL if there is no cache
+static char *cache_path(uint64_t hash) {
+  const char *dir = cache_dir();
+  if (dir == NULL) return NULL;
+  mkdir(dir, 0700);
+
+  size_t len = strlen(dir) + 64;
+  char *path = xmalloc(len);
+  snprintf(path, len, "%s/%016" PRIx64 "-%016" PRIx64 ".img",
+           dir, hash, c0_build_id());
+  return path;
+}
+
+static struct bc0_file *cache_lookup(const char *path, uint64_t hash) {
+  size_t len;
+  void *data = map_file(path, &len, true);
+  if (data == NULL) return NULL;
+
+  struct c0_image_header *h = data;
+  if (!is_image(data, len) || h->source_hash != hash
+      || h->build_id != c0_build_id()) {
+    munmap(data, len);
+    return NULL;
+  }
+  return attach(data, len, true, path);
+}
+
+// Best effort: a cache that cannot be written is just not used
+static void cache_store(const char *path, const void *block, size_t size) {
+  size_t len = strlen(path) + 32;
+  char *tmp = xmalloc(len);
+  snprintf(tmp, len, "%s.%ld.tmp", path, (long) getpid());
+
+  FILE *f = fopen(tmp, "wb");
+  if (f != NULL) {
+    bool ok = fwrite(block, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+  }
+  free(tmp);
+}
+
+
+/*** interface ***/
+
+struct bc0_file *c0_load_program(const char *filename) {
+  REQUIRES(filename != NULL);
+
+  size_t len;
+  void *data = map_file(filename, &len, false);
+  if (data == NULL) return NULL;
+
+  if (is_image(data, len)) return attach(data, len, true, filename);
+
+  uint64_t hash = 0;
+  char *cached = NULL;
+  if (c0_loader_options.cache) {
+    hash = hash_bytes(HASH_SEED, data, len);
+    cached = cache_path(hash);
+    struct bc0_file *bc0 = cached == NULL ? NULL : cache_lookup(cached, hash);
+    if (bc0 != NULL) {
+      munmap(data, len);
+      free(cached);
+      return bc0;
+    }
+  }
+
+  // Images going into the cache must be complete; otherwise only main
+  // is decoded now and the rest on first call
+  bool lazy = cached == NULL;
+  size_t size;
+  size_t *code_at;
+  struct c0_image_header *block = build_image(data, len, !lazy, &size,
+                                              &code_at, filename);
+  if (block == NULL) {
+    munmap(data, len);
+    free(cached);
+    return NULL;
+  }
+  block->source_hash = hash;
+  block->build_id = c0_build_id();
+  if (cached != NULL) cache_store(cached, block, size);
+  free(cached);
+
+  struct bc0_file *bc0 = attach(block, size, false, filename);
+  if (bc0 == NULL || !lazy || bc0->function_count == 1) {
+    munmap(data, len);
+    free(code_at);
+    return bc0;
+  }
+
+  struct loaded *l = (struct loaded *) bc0;
+  l->text = data;
+  l->text_len = len;
+  l->code_at = code_at;
+  l->filename = xmalloc(strlen(filename) + 1);
+  strcpy(l->filename, filename);
+  for (uint16_t i = 1; i < bc0->function_count; i++)
+    bc0->function_pool[i].code = NULL;
+  return bc0;
+}
+
+/* Decodes function fn from the text; false with a message if its body
+ * is not hex bytes after all (pass 1 only counted them) */
+static bool decode(struct bc0_file *bc0, uint16_t fn) {
+  struct loaded *l = (struct loaded *) bc0;
+  struct function_info *f = &bc0->function_pool[fn];
+  if (f->code != NULL) return true;
+  ASSERT(l->text != NULL);
+
+  struct c0_image_header *h = l->block;
+  struct c0_image_fn *fns = (struct c0_image_fn *)
+                            ((char *) l->block + h->function_offset);
+  ubyte *code = (ubyte *) l->block + h->code_offset + fns[fn].code_offset;
+  reader r = { l->text, l->text_len, l->code_at[fn], true, false };
+  rd_bytes(&r, code, f->code_length);
+  if (!reader_ok(&r, l->filename)) return false;
+  f->code = code;
+  return true;
+}
+
+ubyte *c0_load_function(struct bc0_file *bc0, uint16_t fn) {
+  REQUIRES(bc0 != NULL && fn < bc0->function_count);
+  if (!decode(bc0, fn)) {
+    // A context's trap catches this; exiting would take its host along
+    static char msg[64];
+    snprintf(msg, sizeof msg, "cannot decode function %u", (unsigned) fn);
+    c0_memory_error(msg);
+  }
+  return bc0->function_pool[fn].code;
+}
+
+bool c0_load_all_functions(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  bool ok = true;
+  for (uint16_t i = 0; i < bc0->function_count; i++)
+    ok = decode(bc0, i) && ok;
+  return ok;
+}
+
+uint64_t c0_program_id(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  c0_load_all_functions(bc0);
+  uint64_t h = hash_bytes(HASH_SEED, bc0->int_pool,
+                          bc0->int_count * sizeof *bc0->int_pool);
+  h = hash_bytes(h, bc0->string_pool, bc0->string_count);
+  h = hash_bytes(h, bc0->native_pool,
+                 bc0->native_count * sizeof *bc0->native_pool);
+  for (uint16_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *f = &bc0->function_pool[i];
+    ubyte sizes[2] = { f->num_args, f->num_vars };
+    h = hash_bytes(h, sizes, sizeof sizes);
+    if (f->code != NULL) h = hash_bytes(h, f->code, f->code_length);
+  }
+  return h;
+}
+
+void c0_free_program(struct bc0_file *bc0) {
+  if (bc0 == NULL) return;
+  struct loaded *l = (struct loaded *) bc0;
+  free(bc0->function_pool);
+  if (l->mapped) munmap(l->block, l->size);
+  else free(l->block);
+  if (l->text != NULL) munmap((void *) l->text, l->text_len);
+  free(l->code_at);
+  free(l->filename);
+  free(l);
+}
+
+bool c0_write_image(struct bc0_file *bc0, const char *filename) {
+  REQUIRES(bc0 != NULL);
+  struct loaded *l = (struct loaded *) bc0;
+  if (!c0_load_all_functions(bc0)) return false;
+
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  bool ok = fwrite(l->block, 1, l->size, f) == l->size;
+  ok = fclose(f) == 0 && ok;
+  if (!ok) perror(filename);
+  return ok;
+}
@@ -2,15 +2,41 @@
  * Performs some OS compatibility checks before
  * running the VM.
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
-#include <alloca.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <string.h>
 #include "lib/c0vm.h"
+#include "lib/c0vm_heap.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_output.h"
+#include "lib/c0vm_serve.h"
+#include "lib/c0vm_checkpoint.h"
+#include "lib/c0vm_forkserver.h"
+#include "lib/c0vm_debug.h"
+#include "lib/c0vm_allocprof.h"
+#include "lib/c0vm_profile.h"
+#include "lib/c0vm_flame.h"
+#include "lib/c0vm_perf.h"
+#include "lib/c0vm_memo.h"
+#include "lib/c0vm_recorder.h"
 
-/* for the args library */
-int c0_argc;
-char **c0_argv;
+/* for reports written at exit */
+char *program_file;
+struct bc0_file *program;
+char *alloc_profile_file = NULL;
+char *profile_file = NULL;
+char *flame_file = NULL;
+char *perf_file = NULL;
+char *memo_file = NULL;
+char *stats_file = NULL;
+char *image_file = NULL;
+struct timespec exec_start;
 
 /* fail-fast file function wrappers */
 FILE *xfopen(const char *filename, const char *mode, char *error) {
@@ -37,11 +63,326 @@ void xfclose(FILE *stream, char *error) {
   }
 }
 
+/* Opens a report destination, where "-" means stderr */
+FILE *open_report(char *filename) {
+  if (strcmp(filename, "-") == 0) return stderr;
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) perror(filename);
+  return f;
+}
+
+void close_report(FILE *f) {
+  if (f != stderr) fclose(f);
+}
+
+/* Seconds elapsed on the monotonic clock since start */
+double seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Called once after execute() returns, and again at exit so runs that
+ * end in a C0 error are reported too */
+void write_reports(void) {
+  static bool written = false;
+  if (written) return;
+  written = true;
+
+  struct c0_debug_info *dbg = c0_debug_load(program_file);
+  FILE *f;
+
+  if (stats_file != NULL && (f = open_report(stats_file)) != NULL) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double seconds = seconds_since(&exec_start);
+    struct c0_heap_stats heap;
+    c0_heap_stats(&heap);
+    fprintf(f, "instructions=%" PRIu64 " seconds=%.6f maxrss_kb=%ld"
+            " libraries=%u heap_peak=%zu heap_allocated=%" PRIu64 "\n",
+            c0_recorder.next, seconds, ru.ru_maxrss, c0_natives_loaded(),
+            heap.peak, heap.allocated);
+    close_report(f);
+  }
+
+  if (alloc_profile_file != NULL
+      && (f = open_report(alloc_profile_file)) != NULL) {
+    c0_allocprof_report(f, dbg);
+    c0_allocprof_free();
+    close_report(f);
+  }
+
+  if (profile_file != NULL && (f = open_report(profile_file)) != NULL) {
+    c0_profile_report(f, program, dbg);
+    c0_profile_free();
+    close_report(f);
+  }
+
+  if (flame_file != NULL && (f = open_report(flame_file)) != NULL) {
+    c0_flame_report(f, dbg);
+    c0_flame_free();
+    close_report(f);
+  }
+
+  if (perf_file != NULL && (f = open_report(perf_file)) != NULL) {
+    c0_perf_report(f, dbg);
+    c0_perf_free();
+    close_report(f);
+  }
+
+  if (memo_file != NULL && (f = open_report(memo_file)) != NULL) {
+    c0_memo_report(f, dbg);
+    c0_memo_free();
+    close_report(f);
+  }
+
+  c0_debug_free(dbg);
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted values */
+double percentile(double *sorted, int n, int p) {
+  int rank = (p * n + 99) / 100;
+  return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+/* Clears what one run leaves behind for the next: the heap, memoized
+ * results, and the counts of the profiling options */
+void reset_run(void) {
+  c0_heap_reset();
+  if (c0_memo_enabled) c0_memo_reset();
+  if (c0_profile_enabled) c0_profile_reset();
+  if (c0_perf_enabled) c0_perf_reset();
+  c0_flame_free();
+  c0_allocprof_free();
+}
+
+/* --bench: runs the loaded program warmup + runs times, starting each
+ * from a clean state, and reports the timed runs on stderr. Returns the
+ * result of the last run, which is also what the reports describe. */
+int run_bench(struct bc0_file *bc0, int runs, int warmup, double load_seconds) {
+  double *times = xcalloc(runs, sizeof *times);
+  uint64_t instructions = 0;
+  int result = 0;
+  for (int i = -warmup; i < runs; i++) {
+    if (i > -warmup) reset_run();
+    uint64_t before = c0_recorder.next;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = execute(bc0);
+    double t = seconds_since(&start);
+    if (i < 0) continue;
+    times[i] = t;
+    instructions = c0_recorder.next - before;
+  }
+  qsort(times, runs, sizeof *times, compare_doubles);
+  double median = runs % 2 == 1 ? times[runs / 2]
+                : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+
+  fprintf(stderr, "bench: load_ms=%.3f runs=%d warmup=%d\n",
+          load_seconds * 1e3, runs, warmup);
+  fprintf(stderr, "bench: min_ms=%.3f median_ms=%.3f p90_ms=%.3f"
+          " p99_ms=%.3f instructions=%" PRIu64 " instr_per_sec=%.0f\n",
+          times[0] * 1e3, median * 1e3, percentile(times, runs, 90) * 1e3,
+          percentile(times, runs, 99) * 1e3, instructions,
+          median > 0 ? instructions / median : 0.0);
+  free(times);
+  return result;
+}
+
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] <bc0_file> [args...]\n", prog);
+  fprintf(stderr,
+          "options:\n"
+          "  --mmap-threshold=BYTES   back arrays of at least BYTES with mmap"
+          " (0 disables)\n"
+          "  --hugepages=POLICY       never|madvise, for mmap-backed arrays\n"
+          "  --heap-limit=BYTES       fail with a memory error rather than"
+          " hold more\n"
+          "                           than BYTES of objects, arrays and"
+          " frames\n"
+          "  --alloc-profile=FILE     write allocation sites to FILE at exit"
+          " (- for stderr)\n"
+          "  --profile=FILE           write opcode, pair, function and native"
+          " counts\n"
+          "                           to FILE as JSON at exit\n"
+          "  --flame=FILE             time every call path and write folded"
+          " stacks\n"
+          "                           for flamegraph.pl to FILE at exit\n"
+          "  --perf=FILE              count cycles, instructions, branch and"
+          " LLC\n"
+          "                           misses per function, table to FILE at"
+          " exit\n"
+          "  --memo[=ENTRIES]         remember results of pure functions,"
+          " ENTRIES per\n"
+          "                           function (default %d)\n"
+          "  --memo-report=FILE       write calls and hit rates of pure"
+          " functions to FILE\n"
+          "                           at exit (- for stderr)\n"
+          "  --recorder=N             keep the last N instructions for"
+          " post-mortem\n"
+          "                           dumps (default %d, 0 disables)\n"
+          "  --trace                  print every instruction (c0vmd only)\n"
+          "  --stats=FILE             write instructions executed, execution"
+          " time,\n"
+          "                           peak RSS and heap bytes to FILE at"
+          " exit\n"
+          "  --output-buffer=BYTES    buffer print output from the program"
+          " (default 1M,\n"
+          "                           0 leaves it to conio)\n"
+          "  --bench=N                load once, run N times and report"
+          " min, median,\n"
+          "                           p90 and p99 run time on stderr\n"
+          "  --warmup=K               untimed runs before --bench"
+          " (default 1)\n"
+          "  --serve[=SOCKET]         load once and run main for every"
+          " request on\n"
+          "                           stdin or the Unix socket SOCKET,"
+          " see lib/c0vm_serve.h\n"
+          "  --fork-server=SOCKET     run up to the first call of the"
+          " snapshot native,\n"
+          "                           then fork a job from there for every"
+          " connection\n"
+          "  --snapshot-at=NATIVE     the native for --fork-server"
+          " (default readline)\n"
+          "  --checkpoint=FILE        save the running program to FILE on"
+          " SIGUSR1\n"
+          "  --checkpoint-every=SECS  and every SECS seconds\n"
+          "  --restore=FILE           go on from the checkpoint in FILE,"
+          " see\n"
+          "                           lib/c0vm_checkpoint.h\n"
+          "  --cache-dir=DIR          keep decoded programs in DIR (default"
+          " $XDG_CACHE_HOME/c0vm)\n"
+          "  --no-cache               always decode the bc0 file, and do not"
+          " cache it\n"
+          "  --preload-natives        load every C0 library, not just the"
+          " ones the\n"
+          "                           program's natives need\n"
+          "  --write-image=FILE       write the decoded program to FILE as"
+          " an image\n"
+          "                           that loads without parsing, and"
+          " exit\n",
+          C0_MEMO_DEFAULT, C0_RECORDER_DEFAULT);
+  exit(1);
+}
+
+/* Returns the text after "--name=" if opt is that option, else NULL */
+char *option_value(char *opt, char *name) {
+  size_t len = strlen(name);
+  if (strncmp(opt, name, len) != 0 || opt[len] != '=') return NULL;
+  return opt + len + 1;
+}
+
+/* Parses a byte count with an optional k/m/g suffix */
+size_t parse_size(char *s, char *prog) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+  }
+  if (end == s || *end != '\0') usage(prog);
+  return (size_t) n;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "usage: %s <bc0_file> [args...]\n", argv[0]);
-    exit(1);
+  size_t recorder_size = C0_RECORDER_DEFAULT;
+  size_t bench_runs = 0;
+  size_t warmup_runs = 1;
+  bool preload_natives = false;
+  bool serve = false;
+  char *serve_socket = NULL;
+  char *fork_socket = NULL;
+  char *snapshot_at = "readline";
+  char *restore_file = NULL;
+  bool checkpoint_every = false;
+  size_t memo_entries = 0;
+  int argi = 1;
+  for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+    char *opt = argv[argi];
+    char *val;
+    if (strcmp(opt, "--") == 0) {
+      argi++;
+      break;
+    } else if ((val = option_value(opt, "--mmap-threshold")) != NULL) {
+      c0_heap_options.mmap_threshold = parse_size(val, argv[0]);
+    } else if ((val = option_value(opt, "--hugepages")) != NULL) {
+      if (!c0_parse_hugepage_policy(val, &c0_heap_options.hugepages))
+        usage(argv[0]);
+    } else if ((val = option_value(opt, "--heap-limit")) != NULL) {
+      c0_heap_options.limit = parse_size(val, argv[0]);
+    } else if ((val = option_value(opt, "--alloc-profile")) != NULL) {
+      alloc_profile_file = val;
+    } else if ((val = option_value(opt, "--profile")) != NULL) {
+      profile_file = val;
+    } else if ((val = option_value(opt, "--flame")) != NULL) {
+      flame_file = val;
+    } else if ((val = option_value(opt, "--perf")) != NULL) {
+      perf_file = val;
+    } else if (strcmp(opt, "--memo") == 0) {
+      memo_entries = C0_MEMO_DEFAULT;
+    } else if ((val = option_value(opt, "--memo")) != NULL) {
+      memo_entries = parse_size(val, argv[0]);
+      if (memo_entries == 0) usage(argv[0]);
+    } else if ((val = option_value(opt, "--memo-report")) != NULL) {
+      memo_file = val;
+    } else if ((val = option_value(opt, "--recorder")) != NULL) {
+      recorder_size = parse_size(val, argv[0]);
+    } else if ((val = option_value(opt, "--output-buffer")) != NULL) {
+      c0_output_options.buffer_size = parse_size(val, argv[0]);
+    } else if ((val = option_value(opt, "--stats")) != NULL) {
+      stats_file = val;
+    } else if ((val = option_value(opt, "--cache-dir")) != NULL) {
+      c0_loader_options.cache_dir = val;
+    } else if (strcmp(opt, "--preload-natives") == 0) {
+      preload_natives = true;
+    } else if (strcmp(opt, "--no-cache") == 0) {
+      c0_loader_options.cache = false;
+    } else if ((val = option_value(opt, "--write-image")) != NULL) {
+      image_file = val;
+    } else if ((val = option_value(opt, "--bench")) != NULL) {
+      bench_runs = parse_size(val, argv[0]);
+    } else if ((val = option_value(opt, "--warmup")) != NULL) {
+      warmup_runs = parse_size(val, argv[0]);
+    } else if (strcmp(opt, "--serve") == 0) {
+      serve = true;
+    } else if ((val = option_value(opt, "--serve")) != NULL) {
+      serve = true;
+      serve_socket = strcmp(val, "-") == 0 ? NULL : val;
+    } else if ((val = option_value(opt, "--fork-server")) != NULL) {
+      fork_socket = val;
+    } else if ((val = option_value(opt, "--snapshot-at")) != NULL) {
+      snapshot_at = val;
+    } else if ((val = option_value(opt, "--checkpoint")) != NULL) {
+      c0_checkpoint_options.file = val;
+    } else if ((val = option_value(opt, "--checkpoint-every")) != NULL) {
+      char *end;
+      checkpoint_every = true;
+      c0_checkpoint_options.every = strtod(val, &end);
+      if (end == val || *end != '\0' || !(c0_checkpoint_options.every >= 0))
+        usage(argv[0]);
+    } else if ((val = option_value(opt, "--restore")) != NULL) {
+      restore_file = val;
+    } else if (strcmp(opt, "--trace") == 0) {
+      c0_trace_enabled = true;
+    } else {
+      usage(argv[0]);
+    }
   }
+  if (argi >= argc) usage(argv[0]);
+  if (bench_runs > INT_MAX || warmup_runs > INT_MAX) usage(argv[0]);
+  if (serve && bench_runs > 0) usage(argv[0]);
+  if (fork_socket != NULL && (serve || bench_runs > 0)) usage(argv[0]);
+  bool checkpoints = c0_checkpoint_options.file != NULL || restore_file != NULL;
+  if (checkpoints && (serve || bench_runs > 0 || fork_socket != NULL))
+    usage(argv[0]);
+  if (checkpoint_every && c0_checkpoint_options.file == NULL)
+    usage(argv[0]);
 
   /* test for two's complement */
   if (~(-1) != 0) {
@@ -66,34 +407,83 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  /* for the args library -- skip the binary name */
-  c0_argc = argc - 1;
-  c0_argv = argv + 1;
+  /* for the args library -- skip the binary name and VM options */
+  c0_argc = argc - argi;
+  c0_argv = argv + argi;
 
   char *filename = getenv("C0_RESULT_FILE");
 
-  struct bc0_file *bc0 = read_program(argv[1]);
+  program_file = argv[argi];
+  struct timespec load_start;
+  clock_gettime(CLOCK_MONOTONIC, &load_start);
+  struct bc0_file *bc0 = c0_load_program(program_file);
+  double load_seconds = seconds_since(&load_start);
+  if (bc0 == NULL) exit(EXIT_FAILURE);
+  if (image_file != NULL) {
+    bool ok = c0_write_image(bc0, image_file);
+    c0_free_program(bc0);
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  if (!(preload_natives ? c0_natives_bind_all() : c0_natives_bind(bc0)))
+    exit(EXIT_FAILURE);
+  program = bc0;
+  // Served programs print into each response
+  if (serve && c0_output_options.buffer_size == 0)
+    c0_output_options.buffer_size = C0_OUTPUT_DEFAULT;
+  c0_output_init(bc0);
+  if (fork_socket != NULL
+      && !c0_fork_server_init(bc0, program_file, snapshot_at, fork_socket))
+    exit(EXIT_FAILURE);
+  c0_heap_options.track = bench_runs > 0;
 
-  // Move string pool to stack
-  char *stack_allocate_string_pool = alloca(bc0->string_count);
-  for (size_t i = 0; i < bc0->string_count; i++) {
-    stack_allocate_string_pool[i] = bc0->string_pool[i];
+  if (alloc_profile_file != NULL) c0_allocprof_enabled = true;
+  if (profile_file != NULL) {
+    c0_profile_enabled = true;
+    c0_profile_init(bc0);
+  }
+  if (flame_file != NULL) c0_flame_enabled = true;
+  if (memo_file != NULL && memo_entries == 0) memo_entries = C0_MEMO_DEFAULT;
+  if (memo_entries > 0) {
+    c0_memo_enabled = true;
+    c0_memo_init(bc0, memo_entries);
   }
-  free(bc0->string_pool);
-    bc0->string_pool = stack_allocate_string_pool;
+  if (perf_file != NULL) {
+    c0_perf_enabled = true;
+    c0_perf_init(bc0);
+  }
+  atexit(write_reports);
+  atexit(c0_output_flush);
+
+  c0_recorder_init(recorder_size);
+  c0_recorder_attach(bc0, program_file);
 
-  if (filename == NULL) {
-    int result = execute(bc0);
+  clock_gettime(CLOCK_MONOTONIC, &exec_start);
+  if (serve) {
+    if (!c0_serve(bc0, program_file, serve_socket)) exit(EXIT_FAILURE);
+  } else if (filename == NULL) {
+    int result = bench_runs > 0
+               ? run_bench(bc0, bench_runs, warmup_runs, load_seconds)
+               : checkpoints ? c0_checkpoint_execute(bc0, restore_file)
+               : execute(bc0);
+    c0_output_flush();
     printf("%d\n", result);
   } else {
     FILE *f = xfopen(filename, "w", "Couldn't open $C0_RESULT_FILE");
     xfwrite("\0", 1, 1, f, "Couldn't write to $C0_RESULT_FILE");
-    int result = execute(bc0);
+    int result = bench_runs > 0
+               ? run_bench(bc0, bench_runs, warmup_runs, load_seconds)
+               : checkpoints ? c0_checkpoint_execute(bc0, restore_file)
+               : execute(bc0);
+    c0_output_flush();
     printf("Result = %d\n", result);
     xfwrite(&result, sizeof(int), 1, f, "Couldn't write to $C0_RESULT_FILE");
     xfclose(f, "Couldn't close $C0_RESULT_FILE");
   }
 
-  free_program(bc0);
+  write_reports();
+  c0_output_free();
+  c0_heap_release();
+  c0_recorder_free();
+  c0_free_program(bc0);
   return 0;
 }
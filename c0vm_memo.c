@@ -0,0 +1,209 @@
+/* C0VM memoization
+ * A ticket is a serial number above the slot it reserved. The slot
+ * keeps its ticket until another call takes it, so a result comes back
+ * to the slot only if no call of the same function with arguments that
+ * hash there ran (or is running) in between.
+ */
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_loader.h"
+#include "lib/c0vm_opcodes.h"
+#include "lib/c0vm_memo.h"
+
+#define SLOT_MASK (C0_MEMO_MAX - 1)
+
+struct entry {
+  uint64_t ticket;          // of the call that last took the slot
+  int32_t result;
+  bool valid;               // result is that call's
+};
+
+struct table {
+  bool pure;
+  uint8_t num_args;
+  int32_t *keys;            // num_args per entry
+  struct entry *at;         // NULL until the first call
+  uint64_t calls, hits, stores, evictions;
+};
+
+bool c0_memo_enabled = false;
+
+static struct table *tables = NULL;
+static uint16_t table_count = 0;
+static size_t entries = 0;     // per table, a power of two
+static uint64_t serial = 0;
+
+/* Instructions that only compute on ints and constants */
+static bool plain(ubyte op) {
+  switch (op) {
+  case POP: case DUP: case SWAP:
+  case IADD: case ISUB: case IMUL: case IDIV: case IREM:
+  case IAND: case IOR: case IXOR: case ISHL: case ISHR:
+  case BIPUSH: case ILDC: case ALDC: case ACONST_NULL:
+  case VLOAD: case VSTORE: case ATHROW: case ASSERT: case NOP:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT: case IF_ICMPGE:
+  case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+  case INVOKESTATIC: case RETURN:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Whether f has only plain instructions and, if calls_pure, calls
+ * only functions still marked pure */
+static bool scan(struct bc0_file *bc0, struct function_info *f,
+                 bool calls_pure) {
+  size_t pc = 0;
+  while (pc < f->code_length) {
+    ubyte op = f->code[pc];
+    if (!plain(op) || pc + c0_opcode_length(op) > f->code_length)
+      return false;
+    if (calls_pure && op == INVOKESTATIC) {
+      uint16_t callee = f->code[pc + 1] << 8 | f->code[pc + 2];
+      if (callee >= bc0->function_count || !tables[callee].pure)
+        return false;
+    }
+    pc += c0_opcode_length(op);
+  }
+  return true;
+}
+
+void c0_memo_init(struct bc0_file *bc0, size_t n) {
+  REQUIRES(bc0 != NULL);
+  entries = 1;
+  while (entries < n && entries < C0_MEMO_MAX) entries *= 2;
+  table_count = bc0->function_count;
+  tables = xcalloc(table_count + 1, sizeof *tables);
+  c0_load_all_functions(bc0);
+  for (uint16_t i = 0; i < table_count; i++) {
+    struct function_info *f = &bc0->function_pool[i];
+    tables[i].num_args = f->num_args;
+    tables[i].pure = f->code != NULL && scan(bc0, f, false);
+  }
+  // Unmark callers of impure functions until none are left
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint16_t i = 0; i < table_count; i++) {
+      if (tables[i].pure && !scan(bc0, &bc0->function_pool[i], true)) {
+        tables[i].pure = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+static size_t slot_of(c0_value *args, uint8_t num_args) {
+  uint64_t h = num_args;
+  for (uint8_t i = 0; i < num_args; i++)
+    h = (h ^ (uint32_t) val2int(args[i])) * 0x9e3779b97f4a7c15ULL;
+  return (size_t) (h ^ h >> 29) & (entries - 1);
+}
+
+bool c0_memo_lookup(uint16_t fn, c0_value *args, c0_value *result,
+                    uint64_t *ticket) {
+  REQUIRES(fn < table_count);
+  struct table *t = &tables[fn];
+  *ticket = 0;
+  if (!t->pure) return false;
+  for (uint8_t i = 0; i < t->num_args; i++)
+    if (args[i].kind != C0_INTEGER) return false;
+  if (t->at == NULL) {
+    t->at = xcalloc(entries, sizeof *t->at);
+    t->keys = xcalloc(entries * t->num_args + 1, sizeof *t->keys);
+  }
+
+  t->calls++;
+  size_t slot = slot_of(args, t->num_args);
+  struct entry *e = &t->at[slot];
+  int32_t *key = &t->keys[slot * t->num_args];
+  if (e->valid) {
+    uint8_t i = 0;
+    while (i < t->num_args && key[i] == val2int(args[i])) i++;
+    if (i == t->num_args) {
+      t->hits++;
+      *result = int2val(e->result);
+      return true;
+    }
+    t->evictions++;
+  }
+  for (uint8_t i = 0; i < t->num_args; i++) key[i] = val2int(args[i]);
+  e->valid = false;
+  e->ticket = ++serial << C0_MEMO_SLOT_BITS | slot;
+  *ticket = e->ticket;
+  return false;
+}
+
+void c0_memo_store(uint16_t fn, uint64_t ticket, c0_value result) {
+  REQUIRES(fn < table_count && tables[fn].at != NULL);
+  struct table *t = &tables[fn];
+  struct entry *e = &t->at[ticket & SLOT_MASK];
+  if (e->ticket != ticket || result.kind != C0_INTEGER) return;
+  e->result = val2int(result);
+  e->valid = true;
+  t->stores++;
+}
+
+static int by_calls_desc(const void *a, const void *b) {
+  const struct table *x = &tables[*(const uint16_t *) a];
+  const struct table *y = &tables[*(const uint16_t *) b];
+  if (x->calls != y->calls) return x->calls < y->calls ? 1 : -1;
+  return *(const uint16_t *) a - *(const uint16_t *) b;
+}
+
+void c0_memo_report(FILE *out, struct c0_debug_info *dbg) {
+  uint16_t *pure = xcalloc(table_count + 1, sizeof *pure);
+  uint16_t n = 0;
+  uint64_t calls = 0, hits = 0;
+  for (uint16_t i = 0; i < table_count; i++) {
+    if (!tables[i].pure) continue;
+    pure[n++] = i;
+    calls += tables[i].calls;
+    hits += tables[i].hits;
+  }
+  qsort(pure, n, sizeof *pure, by_calls_desc);
+
+  fprintf(out, "# c0vm memoization\n");
+  fprintf(out, "# %u of %u functions pure, %zu entries each,"
+          " %" PRIu64 " calls, %" PRIu64 " hits (%.1f%%)\n",
+          (unsigned) n, (unsigned) table_count, entries, calls, hits,
+          calls > 0 ? 100.0 * hits / calls : 0.0);
+  fprintf(out, "#%-23s %14s %14s %7s %12s %12s\n",
+          "function", "calls", "hits", "rate", "stored", "evicted");
+  for (uint16_t k = 0; k < n; k++) {
+    struct table *t = &tables[pure[k]];
+    char buf[32];
+    fprintf(out, "%-24s %14" PRIu64 " %14" PRIu64 " %6.1f%% %12" PRIu64
+            " %12" PRIu64 "\n",
+            c0_function_name(dbg, pure[k], buf, sizeof buf), t->calls,
+            t->hits, t->calls > 0 ? 100.0 * t->hits / t->calls : 0.0,
+            t->stores, t->evictions);
+  }
+  free(pure);
+}
+
+void c0_memo_reset(void) {
+  for (uint16_t i = 0; i < table_count; i++) {
+    free(tables[i].at);
+    free(tables[i].keys);
+    tables[i].at = NULL;
+    tables[i].keys = NULL;
+    tables[i].calls = tables[i].hits = 0;
+    tables[i].stores = tables[i].evictions = 0;
+  }
+}
+
+void c0_memo_free(void) {
+  for (uint16_t i = 0; i < table_count; i++) {
+    free(tables[i].at);
+    free(tables[i].keys);
+  }
+  free(tables);
+  tables = NULL;
+  table_count = 0;
+}
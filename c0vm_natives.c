@@ -0,0 +1,111 @@
+/* C0VM native libraries
+ * Groups are the sections of c0vm_c0ffi.h, each a contiguous range of
+ * table indices starting at its first NATIVE_* constant. Libraries are
+ * opened RTLD_GLOBAL so the wrappers' PLT entries can find them, and
+ * are never closed. The wrappers and native_function_table live in
+ * libc0ffi.so, the one object linked with its calls into the libraries
+ * unresolved; it is opened lazily too, and under LD_BIND_NOW only
+ * after every library is in.
+ */
+#include <stdio.h>
+#include <dlfcn.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_natives.h"
+
+struct group {
+  const char *library;
+  uint16_t first;        // up to the next group's first index
+  void *handle;
+};
+
+static struct group groups[] = {
+  { "libargs.so",   NATIVE_ARGS_FLAG,   NULL },
+  { "libconio.so",  NATIVE_EOF,         NULL },
+  { "libcurses.so", NATIVE_C_ADDCH,     NULL },
+  { "libdub.so",    NATIVE_DADD,        NULL },
+  { "libfile.so",   NATIVE_FILE_CLOSE,  NULL },
+  { "libfpt.so",    NATIVE_FADD,        NULL },
+  { "libimg.so",    NATIVE_IMAGE_CLONE, NULL },
+  { "libparse.so",  NATIVE_INT_TOKENS,  NULL },
+  { "libstring.so", NATIVE_CHAR_CHR,    NULL },
+};
+
+#define GROUP_COUNT (sizeof groups / sizeof groups[0])
+
+static native_fn **table = NULL;
+
+static bool load(struct group *g) {
+  if (g->handle != NULL) return true;
+  // Found through the executable's rpath, see LINKERFLAGS
+  g->handle = dlopen(g->library, RTLD_LAZY | RTLD_GLOBAL);
+  if (g->handle == NULL) {
+    fprintf(stderr, "c0vm: cannot load native library: %s\n", dlerror());
+    return false;
+  }
+  return true;
+}
+
+static struct group *group_of(uint16_t table_index) {
+  for (size_t i = GROUP_COUNT; i > 0; i--) {
+    if (table_index >= groups[i - 1].first) return &groups[i - 1];
+  }
+  return NULL;
+}
+
+bool c0_natives_bind(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  for (uint16_t i = 0; i < bc0->native_count; i++) {
+    uint16_t index = bc0->native_pool[i].function_table_index;
+    if (index >= NATIVE_FUNCTION_COUNT) {
+      fprintf(stderr, "c0vm: unknown native function %u\n", (unsigned) index);
+      return false;
+    }
+    if (!load(group_of(index))) return false;
+  }
+  return c0_natives_table() != NULL;
+}
+
+static bool load_all(void) {
+  for (size_t i = 0; i < GROUP_COUNT; i++) {
+    if (!load(&groups[i])) return false;
+  }
+  return true;
+}
+
+bool c0_natives_bind_all(void) {
+  return load_all() && c0_natives_table() != NULL;
+}
+
+native_fn **c0_natives_table(void) {
+  if (table != NULL) return table;
+  // Found through the executable's $ORIGIN rpath, see LINKERFLAGS
+  void *ffi = dlopen("libc0ffi.so", RTLD_LAZY);
+  // Binding now needs every library the wrappers call into
+  if (ffi == NULL && load_all())
+    ffi = dlopen("libc0ffi.so", RTLD_LAZY);
+  if (ffi == NULL) {
+    fprintf(stderr, "c0vm: cannot load native wrappers: %s\n", dlerror());
+    return NULL;
+  }
+  table = dlsym(ffi, "native_function_table");
+  if (table == NULL)
+    fprintf(stderr, "c0vm: no native_function_table: %s\n", dlerror());
+  return table;
+}
+
+native_fn **c0_natives_resolve(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL && table != NULL);
+  native_fn **fns = xcalloc(bc0->native_count + 1, sizeof *fns);
+  for (uint16_t i = 0; i < bc0->native_count; i++) {
+    fns[i] = table[bc0->native_pool[i].function_table_index];
+  }
+  return fns;
+}
+
+unsigned c0_natives_loaded(void) {
+  unsigned n = 0;
+  for (size_t i = 0; i < GROUP_COUNT; i++) n += groups[i].handle != NULL;
+  return n;
+}
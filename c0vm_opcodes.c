@@ -0,0 +1,125 @@
+/* C0VM opcode table
+ * Kept in the order of c0vm-ref.txt.
+ */
+#include <stdio.h>
+
+#include "lib/c0vm.h"
+#include "lib/c0vm_opcodes.h"
+
+struct opcode_info {
+  const char *name;
+  unsigned length;
+};
+
+static const struct opcode_info opcodes[256] = {
+  [POP]           = {"pop", 1},
+  [DUP]           = {"dup", 1},
+  [SWAP]          = {"swap", 1},
+
+  [IADD]          = {"iadd", 1},
+  [ISUB]          = {"isub", 1},
+  [IMUL]          = {"imul", 1},
+  [IDIV]          = {"idiv", 1},
+  [IREM]          = {"irem", 1},
+  [IAND]          = {"iand", 1},
+  [IOR]           = {"ior", 1},
+  [IXOR]          = {"ixor", 1},
+  [ISHL]          = {"ishl", 1},
+  [ISHR]          = {"ishr", 1},
+
+  [BIPUSH]        = {"bipush", 2},
+  [ILDC]          = {"ildc", 3},
+  [ALDC]          = {"aldc", 3},
+  [ACONST_NULL]   = {"aconst_null", 1},
+
+  [VLOAD]         = {"vload", 2},
+  [VSTORE]        = {"vstore", 2},
+
+  [ATHROW]        = {"athrow", 1},
+  [ASSERT]        = {"assert", 1},
+
+  [NOP]           = {"nop", 1},
+  [IF_CMPEQ]      = {"if_cmpeq", 3},
+  [IF_CMPNE]      = {"if_cmpne", 3},
+  [IF_ICMPLT]     = {"if_icmplt", 3},
+  [IF_ICMPGE]     = {"if_icmpge", 3},
+  [IF_ICMPGT]     = {"if_icmpgt", 3},
+  [IF_ICMPLE]     = {"if_icmple", 3},
+  [GOTO]          = {"goto", 3},
+
+  [INVOKESTATIC]  = {"invokestatic", 3},
+  [RETURN]        = {"return", 1},
+  [INVOKENATIVE]  = {"invokenative", 3},
+
+  [NEW]           = {"new", 2},
+  [IMLOAD]        = {"imload", 1},
+  [IMSTORE]       = {"imstore", 1},
+  [AMLOAD]        = {"amload", 1},
+  [AMSTORE]       = {"amstore", 1},
+  [CMLOAD]        = {"cmload", 1},
+  [CMSTORE]       = {"cmstore", 1},
+  [AADDF]         = {"aaddf", 2},
+  [NEWARRAY]      = {"newarray", 2},
+  [ARRAYLENGTH]   = {"arraylength", 1},
+  [AADDS]         = {"aadds", 1},
+
+  [CHECKTAG]      = {"checktag", 3},
+  [HASTAG]        = {"hastag", 3},
+  [ADDTAG]        = {"addtag", 3},
+  [ADDROF_STATIC] = {"addrof_static", 3},
+  [ADDROF_NATIVE] = {"addrof_native", 3},
+  [INVOKEDYNAMIC] = {"invokedynamic", 1},
+};
+
+const char *c0_opcode_name(ubyte op) {
+  return opcodes[op].name;
+}
+
+unsigned c0_opcode_length(ubyte op) {
+  return opcodes[op].length;
+}
+
+void c0_disassemble(struct bc0_file *bc0, ubyte *code, size_t code_length,
+                    size_t pc, char *buf, size_t len) {
+  if (code == NULL || pc >= code_length) {
+    snprintf(buf, len, "<pc out of range>");
+    return;
+  }
+
+  ubyte op = code[pc];
+  const char *name = c0_opcode_name(op);
+  unsigned n = c0_opcode_length(op);
+  if (name == NULL || pc + n > code_length) {
+    snprintf(buf, len, "<invalid 0x%02x>", op);
+    return;
+  }
+
+  uint16_t c = n == 3 ? (uint16_t)(code[pc + 1] << 8 | code[pc + 2]) : 0;
+  switch (op) {
+    case BIPUSH:
+      snprintf(buf, len, "%s %d", name, (byte) code[pc + 1]);
+      break;
+    case ILDC:
+      if (c < bc0->int_count)
+        snprintf(buf, len, "%s %u  # %d", name, c, bc0->int_pool[c]);
+      else
+        snprintf(buf, len, "%s %u", name, c);
+      break;
+    case ALDC:
+      if (c < bc0->string_count)
+        snprintf(buf, len, "%s %u  # \"%.32s\"", name, c, &bc0->string_pool[c]);
+      else
+        snprintf(buf, len, "%s %u", name, c);
+      break;
+    case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT: case IF_ICMPGE:
+    case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+      snprintf(buf, len, "%s %+d  # -> %zu", name, (int16_t) c,
+               pc + (int16_t) c);
+      break;
+    default:
+      if (n == 2) snprintf(buf, len, "%s %u", name, code[pc + 1]);
+      else if (n == 3) snprintf(buf, len, "%s %u", name, c);
+      else snprintf(buf, len, "%s", name);
+      break;
+  }
+}
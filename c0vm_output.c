@@ -0,0 +1,277 @@
+/* C0VM output buffer
+ * The replaced natives keep the conio semantics: a NULL string is the
+ * empty string, and output that cannot be written is dropped. The
+ * original table entries are kept so flush, readline and eof can still
+ * call into conio after flushing, and so c0_output_free can put them
+ * back.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_heap.h"
+#include "lib/c0vm_natives.h"
+#include "lib/c0vm_output.h"
+
+struct c0_output_options c0_output_options = {
+  .buffer_size = C0_OUTPUT_DEFAULT,
+};
+
+static char *buf = NULL;
+static size_t size = 0;
+static size_t used = 0;
+static bool line_mode = false;     // stdout is a terminal
+static bool failed = false;        // a write failed, drop the rest
+static native_fn *conio[NATIVE_READLINE + 1];
+static native_fn *printers[NATIVE_PRINT_INT + 1];
+static __thread struct c0_output_capture *capture = NULL;
+
+/* Writes all of iov, retrying partial writes */
+static void write_all(struct iovec *iov, int n) {
+  while (n > 0 && !failed) {
+    ssize_t w = writev(STDOUT_FILENO, iov, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      return;
+    }
+    while (n > 0 && (size_t) w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+}
+
+void c0_output_flush(void) {
+  if (used == 0) return;
+  // Anything printed through stdio so far goes first
+  fflush(stdout);
+  struct iovec iov = { buf, used };
+  write_all(&iov, 1);
+  used = 0;
+}
+
+static void append(struct c0_output_capture *cap, const char *s, size_t n) {
+  if (cap->len + n > cap->capacity) {
+    size_t capacity = cap->capacity == 0 ? 256 : cap->capacity;
+    while (capacity < cap->len + n) capacity *= 2;
+    char *grown = xmalloc(capacity);
+    if (cap->len > 0) memcpy(grown, cap->data, cap->len);
+    free(cap->data);
+    cap->data = grown;
+    cap->capacity = capacity;
+  }
+  memcpy(cap->data + cap->len, s, n);
+  cap->len += n;
+}
+
+/* Appends s and then tail; what does not fit goes out with the buffer
+ * in one writev rather than being copied */
+static void emit(const char *s, size_t n, const char *tail, size_t tail_n) {
+  if (capture != NULL) {
+    append(capture, s, n);
+    append(capture, tail, tail_n);
+    return;
+  }
+  if (used + n + tail_n <= size) {
+    memcpy(buf + used, s, n);
+    memcpy(buf + used + n, tail, tail_n);
+    used += n + tail_n;
+  } else {
+    fflush(stdout);
+    struct iovec iov[3] = {
+      { buf, used }, { (char *) s, n }, { (char *) tail, tail_n }
+    };
+    write_all(iov, 3);
+    used = 0;
+  }
+  if (line_mode && (tail_n > 0 || memchr(s, '\n', n) != NULL))
+    c0_output_flush();
+}
+
+static const char *str(c0_value v) {
+  const char *s = val2ptr(v);
+  return s == NULL ? "" : s;
+}
+
+static c0_value out_print(c0_value *args) {
+  const char *s = str(args[0]);
+  emit(s, strlen(s), "", 0);
+  return int2val(0);
+}
+
+static c0_value out_println(c0_value *args) {
+  const char *s = str(args[0]);
+  emit(s, strlen(s), "\n", 1);
+  return int2val(0);
+}
+
+static c0_value out_printint(c0_value *args) {
+  int32_t i = val2int(args[0]);
+  uint32_t u = i < 0 ? -(uint32_t) i : (uint32_t) i;
+  char digits[12];
+  char *p = digits + sizeof digits;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (i < 0) *--p = '-';
+  emit(p, digits + sizeof digits - p, "", 0);
+  return int2val(0);
+}
+
+static c0_value out_printchar(c0_value *args) {
+  char c = (char) val2int(args[0]);
+  emit(&c, 1, "", 0);
+  return int2val(0);
+}
+
+static c0_value out_printbool(c0_value *args) {
+  if (val2int(args[0])) emit("true", 4, "", 0);
+  else emit("false", 5, "", 0);
+  return int2val(0);
+}
+
+/* print_dub, print_fpt, print_hex and print_int call printf, so what
+ * is buffered goes out first; stdio output is flushed before the buffer
+ * from then on. Captured output has nowhere to put it, and it must not
+ * reach the stdout that --serve and c0vm-batch report on. */
+static c0_value around_stdio(uint16_t table_index, const char *name,
+                             c0_value *args) {
+  if (capture != NULL) {
+    static __thread char message[64];
+    snprintf(message, sizeof message, "%s cannot be captured", name);
+    c0_value_error(message);
+  }
+  c0_output_flush();
+  return (*printers[table_index])(args);
+}
+
+static c0_value out_print_dub(c0_value *args) {
+  return around_stdio(NATIVE_PRINT_DUB, "print_dub", args);
+}
+
+static c0_value out_print_fpt(c0_value *args) {
+  return around_stdio(NATIVE_PRINT_FPT, "print_fpt", args);
+}
+
+static c0_value out_print_hex(c0_value *args) {
+  return around_stdio(NATIVE_PRINT_HEX, "print_hex", args);
+}
+
+static c0_value out_print_int(c0_value *args) {
+  return around_stdio(NATIVE_PRINT_INT, "print_int", args);
+}
+
+static c0_value out_flush(c0_value *args) {
+  if (capture != NULL) return int2val(0);
+  c0_output_flush();
+  return (*conio[NATIVE_FLUSH])(args);
+}
+
+/* A line of capture->input without its newline, in the calling thread's
+ * heap like every other string the VM makes */
+static c0_value captured_line(struct c0_output_capture *cap) {
+  const char *start = cap->input + cap->input_pos;
+  size_t left = cap->input_len - cap->input_pos;
+  const char *nl = memchr(start, '\n', left);
+  size_t n = nl == NULL ? left : (size_t) (nl - start);
+  char *line = c0_object_alloc(n + 1);
+  memcpy(line, start, n);
+  cap->input_pos += nl == NULL ? n : n + 1;
+  return ptr2val(line);
+}
+
+static c0_value out_readline(c0_value *args) {
+  if (capture != NULL && capture->input != NULL)
+    return captured_line(capture);
+  c0_output_flush();
+  return (*conio[NATIVE_READLINE])(args);
+}
+
+static c0_value out_eof(c0_value *args) {
+  if (capture != NULL && capture->input != NULL)
+    return int2val(capture->input_pos >= capture->input_len);
+  c0_output_flush();
+  return (*conio[NATIVE_EOF])(args);
+}
+
+bool c0_output_would_block(uint16_t table_index) {
+  struct c0_output_capture *cap = capture;
+  if (cap == NULL || cap->input == NULL || !cap->input_open) return false;
+  size_t left = cap->input_len - cap->input_pos;
+  if (table_index == NATIVE_EOF) return left == 0;
+  if (table_index == NATIVE_READLINE)
+    return memchr(cap->input + cap->input_pos, '\n', left) == NULL;
+  return false;
+}
+
+bool c0_output_uses_curses(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  for (uint16_t i = 0; i < bc0->native_count; i++) {
+    uint16_t index = bc0->native_pool[i].function_table_index;
+    if (index >= NATIVE_C_ADDCH && index < NATIVE_DADD) return true;
+  }
+  return false;
+}
+
+void c0_output_init(struct bc0_file *bc0) {
+  if (c0_output_options.buffer_size == 0) return;
+  if (bc0 != NULL && c0_output_uses_curses(bc0)) return;
+  native_fn **table = c0_natives_table();
+  if (table == NULL) return;
+  size = c0_output_options.buffer_size;
+  buf = xmalloc(size);
+  used = 0;
+  line_mode = isatty(STDOUT_FILENO);
+
+  for (int i = NATIVE_EOF; i <= NATIVE_READLINE; i++)
+    conio[i] = table[i];
+  table[NATIVE_EOF] = out_eof;
+  table[NATIVE_FLUSH] = out_flush;
+  table[NATIVE_PRINT] = out_print;
+  table[NATIVE_PRINTBOOL] = out_printbool;
+  table[NATIVE_PRINTCHAR] = out_printchar;
+  table[NATIVE_PRINTINT] = out_printint;
+  table[NATIVE_PRINTLN] = out_println;
+  table[NATIVE_READLINE] = out_readline;
+
+  printers[NATIVE_PRINT_DUB] = table[NATIVE_PRINT_DUB];
+  printers[NATIVE_PRINT_FPT] = table[NATIVE_PRINT_FPT];
+  printers[NATIVE_PRINT_HEX] = table[NATIVE_PRINT_HEX];
+  printers[NATIVE_PRINT_INT] = table[NATIVE_PRINT_INT];
+  table[NATIVE_PRINT_DUB] = out_print_dub;
+  table[NATIVE_PRINT_FPT] = out_print_fpt;
+  table[NATIVE_PRINT_HEX] = out_print_hex;
+  table[NATIVE_PRINT_INT] = out_print_int;
+}
+
+void c0_output_capture(struct c0_output_capture *cap) {
+  capture = cap;
+}
+
+void c0_output_free(void) {
+  if (buf == NULL) return;
+  c0_output_flush();
+  native_fn **table = c0_natives_table();
+  for (int i = NATIVE_EOF; i <= NATIVE_READLINE; i++)
+    table[i] = conio[i];
+  table[NATIVE_PRINT_DUB] = printers[NATIVE_PRINT_DUB];
+  table[NATIVE_PRINT_FPT] = printers[NATIVE_PRINT_FPT];
+  table[NATIVE_PRINT_HEX] = printers[NATIVE_PRINT_HEX];
+  table[NATIVE_PRINT_INT] = printers[NATIVE_PRINT_INT];
+  free(buf);
+  buf = NULL;
+  size = 0;
+}
@@ -0,0 +1,218 @@
+/* C0VM hardware counters per function
+ * All counters are opened as one group with PERF_FORMAT_GROUP, so a
+ * switch costs a single read(2). Counters the kernel refuses are left
+ * out of the group rather than failing the whole mode.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "lib/xalloc.h"
+#include "lib/contracts.h"
+#include "lib/c0vm_perf.h"
+
+#define MAX_COUNTERS 4
+
+struct counter_spec {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+static const struct counter_spec hardware[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"LLC-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_LL
+   | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static const struct counter_spec software[] = {
+  {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static const struct counter_spec cpu_time = {"cpu-time(ns)", 0, 0};
+
+bool c0_perf_enabled = false;
+
+static int group_fd = -1;            // -1: use clock_gettime instead
+static int fds[MAX_COUNTERS];
+static unsigned ncounters = 0;
+static const struct counter_spec *counters[MAX_COUNTERS];
+static uint64_t last[MAX_COUNTERS];
+
+static uint16_t function_count = 0;
+static uint64_t *totals = NULL;      // [function][counter]
+static uint64_t *calls = NULL;
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid,
+                            int cpu, int group, unsigned long flags) {
+  return syscall(__NR_perf_event_open, attr, pid, cpu, group, flags);
+}
+
+static int open_counter(const struct counter_spec *c, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = c->type;
+  attr.config = c->config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = group == -1;
+  return (int) perf_event_open(&attr, 0, -1, group, 0);
+}
+
+/* Opens as many of specs as the kernel allows; returns how many */
+static unsigned open_group(const struct counter_spec *specs, size_t n) {
+  for (size_t i = 0; i < n && ncounters < MAX_COUNTERS; i++) {
+    int fd = open_counter(&specs[i], group_fd);
+    if (fd < 0) continue;
+    if (group_fd == -1) group_fd = fd;
+    fds[ncounters] = fd;
+    counters[ncounters++] = &specs[i];
+  }
+  return ncounters;
+}
+
+static void read_counters(uint64_t *out) {
+  if (group_fd == -1) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    out[0] = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    return;
+  }
+
+  uint64_t buf[1 + MAX_COUNTERS];
+  if (read(group_fd, buf, sizeof buf) < (ssize_t) sizeof(uint64_t)) {
+    memset(out, 0, ncounters * sizeof *out);
+    return;
+  }
+  for (unsigned i = 0; i < ncounters; i++)
+    out[i] = i < buf[0] ? buf[1 + i] : 0;
+}
+
+void c0_perf_init(struct bc0_file *bc0) {
+  if (open_group(hardware, sizeof hardware / sizeof hardware[0]) == 0)
+    open_group(software, sizeof software / sizeof software[0]);
+  if (ncounters == 0) {
+    counters[0] = &cpu_time;
+    ncounters = 1;
+  }
+
+  fprintf(stderr, "c0vm: perf counters:");
+  for (unsigned i = 0; i < ncounters; i++)
+    fprintf(stderr, " %s", counters[i]->name);
+  fprintf(stderr, "\n");
+
+  function_count = bc0->function_count;
+  totals = xcalloc((size_t)(function_count + 1) * MAX_COUNTERS,
+                   sizeof *totals);
+  calls = xcalloc(function_count + 1, sizeof *calls);
+
+  if (group_fd != -1) {
+    ioctl(group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  read_counters(last);
+}
+
+void c0_perf_switch(uint16_t fn) {
+  REQUIRES(fn < function_count);
+  uint64_t now[MAX_COUNTERS];
+  read_counters(now);
+  uint64_t *row = &totals[(size_t)fn * MAX_COUNTERS];
+  for (unsigned i = 0; i < ncounters; i++) {
+    row[i] += now[i] - last[i];
+    last[i] = now[i];
+  }
+}
+
+void c0_perf_reset(void) {
+  memset(totals, 0, (size_t) function_count * MAX_COUNTERS * sizeof *totals);
+  memset(calls, 0, function_count * sizeof *calls);
+  read_counters(last);
+}
+
+void c0_perf_call(uint16_t callee) {
+  REQUIRES(callee < function_count);
+  calls[callee]++;
+}
+
+static int index_of(const char *name) {
+  for (unsigned i = 0; i < ncounters; i++)
+    if (strcmp(counters[i]->name, name) == 0) return (int) i;
+  return -1;
+}
+
+static uint16_t *order = NULL;   // for sorting function indices
+
+static int by_first_counter_desc(const void *a, const void *b) {
+  uint64_t x = totals[(size_t)*(const uint16_t *)a * MAX_COUNTERS];
+  uint64_t y = totals[(size_t)*(const uint16_t *)b * MAX_COUNTERS];
+  if (x != y) return x < y ? 1 : -1;
+  return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+void c0_perf_report(FILE *out, struct c0_debug_info *dbg) {
+  int cyc = index_of("cycles");
+  int ins = index_of("instructions");
+  int brm = index_of("branch-misses");
+  int llc = index_of("LLC-misses");
+
+  order = xcalloc(function_count + 1, sizeof *order);
+  uint16_t n = 0;
+  for (uint16_t f = 0; f < function_count; f++)
+    if (calls[f] > 0) order[n++] = f;
+  qsort(order, n, sizeof *order, by_first_counter_desc);
+
+  fprintf(out, "%-24s %10s", "function", "calls");
+  for (unsigned i = 0; i < ncounters; i++)
+    fprintf(out, " %16s", counters[i]->name);
+  if (cyc >= 0 && ins >= 0) fprintf(out, " %6s", "IPC");
+  if (brm >= 0 && ins >= 0) fprintf(out, " %10s", "br-MPKI");
+  if (llc >= 0 && ins >= 0) fprintf(out, " %10s", "LLC-MPKI");
+  fprintf(out, "\n");
+
+  for (uint16_t k = 0; k < n; k++) {
+    char buf[32];
+    uint64_t *row = &totals[(size_t)order[k] * MAX_COUNTERS];
+    fprintf(out, "%-24s %10" PRIu64,
+            c0_function_name(dbg, order[k], buf, sizeof buf), calls[order[k]]);
+    for (unsigned i = 0; i < ncounters; i++)
+      fprintf(out, " %16" PRIu64, row[i]);
+
+    double kinstr = ins >= 0 ? row[ins] / 1000.0 : 0;
+    if (cyc >= 0 && ins >= 0)
+      fprintf(out, " %6.2f", row[cyc] == 0 ? 0.0 : (double) row[ins] / row[cyc]);
+    if (brm >= 0 && ins >= 0)
+      fprintf(out, " %10.2f", kinstr == 0 ? 0.0 : row[brm] / kinstr);
+    if (llc >= 0 && ins >= 0)
+      fprintf(out, " %10.2f", kinstr == 0 ? 0.0 : row[llc] / kinstr);
+    fprintf(out, "\n");
+  }
+
+  free(order);
+  order = NULL;
+}
+
+void c0_perf_free(void) {
+  if (group_fd != -1) {
+    for (unsigned i = 0; i < ncounters; i++) close(fds[i]);
+  }
+  group_fd = -1;
+  ncounters = 0;
+  free(totals);
+  free(calls);
+  totals = calls = NULL;
+}
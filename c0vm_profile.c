@@ -0,0 +1,152 @@
+/* C0VM execution profiler
+ * The dispatch loop only bumps pairs[prev][op]; single opcode counts
+ * are the column sums of that table. Per-function instruction counts
+ * are charged in bulk whenever control moves between functions.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm_opcodes.h"
+#include "lib/c0vm_profile.h"
+
+bool c0_profile_enabled = false;
+struct c0_profile c0_profile;
+
+void c0_profile_init(struct bc0_file *bc0) {
+  c0_profile.function_count = bc0->function_count;
+  c0_profile.fn_instrs = xcalloc(bc0->function_count + 1, sizeof(uint64_t));
+  c0_profile.fn_calls = xcalloc(bc0->function_count + 1, sizeof(uint64_t));
+  c0_profile.native_count = bc0->native_count;
+  c0_profile.native_calls = xcalloc(bc0->native_count + 1, sizeof(uint64_t));
+}
+
+void c0_profile_reset(void) {
+  memset(c0_profile.pairs, 0, sizeof c0_profile.pairs);
+  memset(c0_profile.fn_instrs, 0,
+         c0_profile.function_count * sizeof(uint64_t));
+  memset(c0_profile.fn_calls, 0, c0_profile.function_count * sizeof(uint64_t));
+  memset(c0_profile.native_calls, 0,
+         c0_profile.native_count * sizeof(uint64_t));
+  c0_profile.mark = 0;
+}
+
+void c0_profile_free(void) {
+  free(c0_profile.fn_instrs);
+  free(c0_profile.fn_calls);
+  free(c0_profile.native_calls);
+  c0_profile.fn_instrs = c0_profile.fn_calls = c0_profile.native_calls = NULL;
+}
+
+typedef struct {
+  unsigned first, second;  // first == C0_PROFILE_START for opcode totals
+  uint64_t count;
+} entry;
+
+static int by_count_desc(const void *a, const void *b) {
+  const entry *x = a, *y = b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  if (x->first != y->first) return x->first < y->first ? -1 : 1;
+  return x->second < y->second ? -1 : x->second > y->second;
+}
+
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+    else fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void json_opcode(FILE *out, unsigned op) {
+  const char *name = op == C0_PROFILE_START ? "<start>"
+                   : c0_opcode_name((ubyte) op);
+  if (name != NULL) {
+    json_string(out, name);
+  } else {
+    fprintf(out, "\"0x%02x\"", op);
+  }
+}
+
+void c0_profile_report(FILE *out, struct bc0_file *bc0,
+                       struct c0_debug_info *dbg) {
+  char buf[32];
+
+  uint64_t totals[256] = {0};
+  uint64_t instructions = 0;
+  size_t npairs = 0;
+  for (unsigned i = 0; i <= C0_PROFILE_START; i++) {
+    for (unsigned j = 0; j < 256; j++) {
+      uint64_t n = c0_profile.pairs[i][j];
+      if (n == 0) continue;
+      totals[j] += n;
+      instructions += n;
+      if (i != C0_PROFILE_START) npairs++;
+    }
+  }
+
+  entry *ops = xcalloc(256, sizeof *ops);
+  size_t nops = 0;
+  for (unsigned j = 0; j < 256; j++) {
+    if (totals[j] == 0) continue;
+    ops[nops++] = (entry){ C0_PROFILE_START, j, totals[j] };
+  }
+  qsort(ops, nops, sizeof *ops, by_count_desc);
+
+  entry *pairs = xcalloc(npairs + 1, sizeof *pairs);
+  size_t k = 0;
+  for (unsigned i = 0; i < C0_PROFILE_START; i++) {
+    for (unsigned j = 0; j < 256; j++) {
+      if (c0_profile.pairs[i][j] != 0)
+        pairs[k++] = (entry){ i, j, c0_profile.pairs[i][j] };
+    }
+  }
+  qsort(pairs, npairs, sizeof *pairs, by_count_desc);
+
+  fprintf(out, "{\n  \"instructions\": %" PRIu64 ",\n", instructions);
+
+  fprintf(out, "  \"opcodes\": [");
+  for (size_t i = 0; i < nops; i++) {
+    fprintf(out, "%s\n    {\"opcode\": ", i == 0 ? "" : ",");
+    json_opcode(out, ops[i].second);
+    fprintf(out, ", \"code\": %u, \"count\": %" PRIu64 "}",
+            ops[i].second, ops[i].count);
+  }
+  fprintf(out, "\n  ],\n");
+
+  fprintf(out, "  \"pairs\": [");
+  for (size_t i = 0; i < npairs; i++) {
+    fprintf(out, "%s\n    {\"first\": ", i == 0 ? "" : ",");
+    json_opcode(out, pairs[i].first);
+    fprintf(out, ", \"second\": ");
+    json_opcode(out, pairs[i].second);
+    fprintf(out, ", \"count\": %" PRIu64 "}", pairs[i].count);
+  }
+  fprintf(out, "\n  ],\n");
+
+  fprintf(out, "  \"functions\": [");
+  for (uint16_t i = 0; i < c0_profile.function_count; i++) {
+    fprintf(out, "%s\n    {\"index\": %u, \"name\": ", i == 0 ? "" : ",",
+            (unsigned) i);
+    json_string(out, c0_function_name(dbg, i, buf, sizeof buf));
+    fprintf(out, ", \"calls\": %" PRIu64 ", \"instructions\": %" PRIu64 "}",
+            c0_profile.fn_calls[i], c0_profile.fn_instrs[i]);
+  }
+  fprintf(out, "\n  ],\n");
+
+  fprintf(out, "  \"natives\": [");
+  for (uint16_t i = 0; i < c0_profile.native_count; i++) {
+    fprintf(out, "%s\n    {\"index\": %u, \"table_index\": %u, \"name\": ",
+            i == 0 ? "" : ",", (unsigned) i,
+            (unsigned) bc0->native_pool[i].function_table_index);
+    json_string(out, c0_native_name(dbg, i, buf, sizeof buf));
+    fprintf(out, ", \"calls\": %" PRIu64 "}", c0_profile.native_calls[i]);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  free(ops);
+  free(pairs);
+}
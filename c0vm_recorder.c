@@ -0,0 +1,103 @@
+/* C0VM flight recorder
+ * Recording is three stores and an increment; everything else here only
+ * runs once the program is already dying. With dumps turned off the
+ * ring has a single slot, so the dispatch loop never has to test for it.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm_opcodes.h"
+#include "lib/c0vm_recorder.h"
+
+static struct c0_record off_slot;
+
+struct c0_recorder c0_recorder = { &off_slot, 0, 0, NULL, NULL };
+
+bool c0_trace_enabled = false;
+
+static bool dumps_enabled = false;
+
+static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static void on_fatal_signal(int sig) {
+  // Best effort: stdio is not async-signal-safe, but the process is
+  // about to die anyway and this is the context we want.
+  fprintf(stderr, "c0vm: fatal signal %d\n", sig);
+  c0_recorder_dump(stderr, NULL);
+  fflush(stderr);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+void c0_recorder_init(size_t n) {
+  c0_recorder_free();
+  if (n == 0) return;
+
+  size_t size = 1;
+  while (size < n) size <<= 1;
+  c0_recorder.ring = xcalloc(size, sizeof *c0_recorder.ring);
+  c0_recorder.mask = size - 1;
+  dumps_enabled = true;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = on_fatal_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESETHAND;
+  for (size_t i = 0; i < sizeof fatal_signals / sizeof fatal_signals[0]; i++)
+    sigaction(fatal_signals[i], &sa, NULL);
+}
+
+void c0_recorder_attach(struct bc0_file *bc0, const char *filename) {
+  c0_recorder.program = bc0;
+  c0_recorder.filename = filename;
+}
+
+void c0_recorder_dump(FILE *out, struct c0_debug_info *dbg) {
+  if (!dumps_enabled || c0_recorder.next == 0) return;
+
+  uint64_t size = c0_recorder.mask + 1;
+  uint64_t count = c0_recorder.next < size ? c0_recorder.next : size;
+  struct bc0_file *bc0 = c0_recorder.program;
+
+  fprintf(out, "c0vm: last %" PRIu64 " of %" PRIu64
+          " instructions executed (oldest first):\n", count, c0_recorder.next);
+  for (uint64_t i = c0_recorder.next - count; i < c0_recorder.next; i++) {
+    struct c0_record *r = &c0_recorder.ring[i & c0_recorder.mask];
+    char name[32], insn[96];
+    const char *fn = c0_function_name(dbg, r->fn, name, sizeof name);
+
+    if (bc0 != NULL && r->fn < bc0->function_count) {
+      struct function_info *f = &bc0->function_pool[r->fn];
+      c0_disassemble(bc0, f->code, f->code_length, r->pc, insn, sizeof insn);
+    } else {
+      snprintf(insn, sizeof insn, "opcode 0x%02x", r->opcode);
+    }
+    fprintf(out, "  %*s%s+%" PRIu32 ": %s\n",
+            2 * (r->depth < 16 ? r->depth : 16), "", fn, r->pc, insn);
+  }
+}
+
+void c0_recorder_dump_on_error(void) {
+  if (!dumps_enabled) return;
+  struct c0_debug_info *dbg = c0_recorder.filename == NULL ? NULL
+                            : c0_debug_load(c0_recorder.filename);
+  c0_recorder_dump(stderr, dbg);
+  c0_debug_free(dbg);
+  // The runtime goes on to raise a signal; the ring is out already
+  dumps_enabled = false;
+  for (size_t i = 0; i < sizeof fatal_signals / sizeof fatal_signals[0]; i++)
+    signal(fatal_signals[i], SIG_DFL);
+}
+
+void c0_recorder_free(void) {
+  if (c0_recorder.ring != &off_slot) free(c0_recorder.ring);
+  c0_recorder.ring = &off_slot;
+  c0_recorder.mask = 0;
+  c0_recorder.next = 0;
+  dumps_enabled = false;
+}
@@ -0,0 +1,232 @@
+/* C0VM server mode
+ * A request that breaks the framing (a short read, or a count over the
+ * limits in lib/c0vm_serve.h) ends its connection; on stdin it ends
+ * the server. Runtime errors in the program only end the request.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lib/xalloc.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_output.h"
+#include "lib/c0vm_serve.h"
+
+struct request {
+  uint32_t argc;              // including argv[0], the program
+  char **argv;
+  char *input;
+  uint32_t input_len;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+static bool read_all(int fd, void *p, size_t n) {
+  char *c = p;
+  while (n > 0) {
+    ssize_t r = read(fd, c, n);
+    if (r < 0 && errno == EINTR && !stopping) continue;
+    if (r <= 0) return false;
+    c += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+  const char *c = p;
+  while (n > 0) {
+    ssize_t w = write(fd, c, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) return false;
+    c += w;
+    n -= w;
+  }
+  return true;
+}
+
+static bool read_u32(int fd, uint32_t *x) {
+  unsigned char b[4];
+  if (!read_all(fd, b, 4)) return false;
+  *x = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+  return true;
+}
+
+static void put_u32(char *p, uint32_t x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+/* A length-prefixed string, NUL-terminated for the program's sake */
+static char *read_bytes(int fd, uint32_t *len) {
+  if (!read_u32(fd, len) || *len > C0_SERVE_MAX_BYTES) return NULL;
+  char *s = xmalloc((size_t) *len + 1);
+  if (!read_all(fd, s, *len)) {
+    free(s);
+    return NULL;
+  }
+  s[*len] = '\0';
+  return s;
+}
+
+static void free_request(struct request *r) {
+  if (r->argv != NULL) {
+    for (uint32_t i = 1; i < r->argc; i++) free(r->argv[i]);
+    free(r->argv);
+  }
+  free(r->input);
+}
+
+static bool read_request(int fd, struct request *r, char *filename) {
+  uint32_t argc, len;
+  memset(r, 0, sizeof *r);
+  if (!read_u32(fd, &argc) || argc > C0_SERVE_MAX_ARGS) return false;
+  r->argv = xcalloc((size_t) argc + 2, sizeof *r->argv);
+  r->argv[0] = filename;
+  r->argc = 1;
+  for (uint32_t i = 0; i < argc; i++) {
+    if ((r->argv[r->argc] = read_bytes(fd, &len)) == NULL) return false;
+    r->argc++;
+  }
+  r->input = read_bytes(fd, &r->input_len);
+  return r->input != NULL;
+}
+
+static bool write_string(int fd, const char *s) {
+  size_t len = s == NULL ? 0 : strlen(s);
+  char prefix[4];
+  put_u32(prefix, len);
+  return write_all(fd, prefix, sizeof prefix) && write_all(fd, s, len);
+}
+
+static bool respond(int fd, int32_t result, struct c0_output_capture *out,
+                    struct c0_vm_fault *fault) {
+  char head[12];
+  put_u32(head, fault->status);
+  put_u32(head + 4, (uint32_t) result);
+  put_u32(head + 8, out->len);
+  char pc[4];
+  put_u32(pc, fault->pc);
+  char name[16];
+  const char *function = fault->function_name;
+  if (function == NULL && fault->function >= 0) {
+    snprintf(name, sizeof name, "fn#%d", fault->function);
+    function = name;
+  }
+  return write_all(fd, head, sizeof head)
+      && write_all(fd, out->data, out->len)
+      && write_string(fd, fault->message)
+      && write_string(fd, function)
+      && write_all(fd, pc, sizeof pc);
+}
+
+/* Runs requests from in until it ends or a response cannot be sent */
+static void serve_stream(c0_vm *vm, char *filename, int in, int out) {
+  struct c0_output_capture cap = { NULL, 0, 0, NULL, 0, 0, false };
+  struct request r;
+  bool ok = true;
+  while (ok && !stopping) {
+    if (!read_request(in, &r, filename)) {
+      free_request(&r);
+      break;
+    }
+    cap.len = 0;
+    cap.input = r.input;
+    cap.input_len = r.input_len;
+    cap.input_pos = 0;
+    c0_argc = r.argc;
+    c0_argv = r.argv;
+
+    c0_value result;
+    c0_output_capture(&cap);
+    enum c0_vm_status status = c0_vm_call(vm, 0, NULL, 0, &result);
+    c0_output_capture(NULL);
+    struct c0_vm_fault fault = { C0_VM_OK, NULL, -1, NULL, 0, 0, 0 };
+    if (status != C0_VM_OK) c0_vm_fault(vm, &fault);
+    ok = respond(out, status == C0_VM_OK ? val2int(result) : 0, &cap,
+                 &fault);
+    c0_vm_reset(vm);
+    free_request(&r);
+  }
+  free(cap.data);
+}
+
+int c0_serve_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "c0vm: socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen(fd, 16) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool c0_serve(struct bc0_file *bc0, char *filename, const char *socket_path) {
+  if (c0_output_uses_curses(bc0)) {
+    fprintf(stderr, "c0vm: cannot serve a program that uses curses\n");
+    return false;
+  }
+  if (bc0->function_pool[0].num_args != 0) {
+    fprintf(stderr, "c0vm: main takes arguments\n");
+    return false;
+  }
+  c0_vm *vm = c0_vm_new(bc0, filename);
+  if (vm == NULL) return false;
+  // A client that goes away only ends its connection
+  signal(SIGPIPE, SIG_IGN);
+
+  if (socket_path == NULL) {
+    serve_stream(vm, filename, STDIN_FILENO, STDOUT_FILENO);
+    c0_vm_free(vm);
+    return true;
+  }
+
+  int fd = c0_serve_listen(socket_path);
+  if (fd < 0) {
+    c0_vm_free(vm);
+    return false;
+  }
+  // No SA_RESTART, so accept returns when asked to stop
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  while (!stopping) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    serve_stream(vm, filename, conn, conn);
+    close(conn);
+  }
+  close(fd);
+  unlink(socket_path);
+  c0_vm_free(vm);
+  return true;
+}
@@ -0,0 +1,34 @@
+/* C0VM allocation profiler
+ * Counts heap allocations per allocation site, i.e. per
+ * (kind, function index, pc) triple, with a log2 size histogram.
+ */
+
+#ifndef C0VM_ALLOCPROF_H
+#define C0VM_ALLOCPROF_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c0vm_debug.h"
+
+enum c0_alloc_kind {
+  C0_ALLOC_NEW,        // NEW <s>
+  C0_ALLOC_NEWARRAY,   // NEWARRAY <s>, header plus elements
+  C0_ALLOC_TAG,        // ADDTAG box
+  C0_ALLOC_NATIVE,     // string (or array) returned by a native
+  C0_ALLOC_KINDS
+};
+
+extern bool c0_allocprof_enabled;
+
+void c0_allocprof_record(enum c0_alloc_kind kind, uint16_t fn, size_t pc,
+                         size_t bytes);
+
+// Sites sorted by total bytes, largest first
+void c0_allocprof_report(FILE *out, struct c0_debug_info *dbg);
+
+void c0_allocprof_free(void);
+
+#endif /* C0VM_ALLOCPROF_H */
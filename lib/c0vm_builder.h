@@ -0,0 +1,59 @@
+/* C0VM bytecode builder
+ * Builds a struct bc0_file in memory, without cc0: constant pools,
+ * natives, functions, and code with forward and backward branches to
+ * labels. The result can be passed to execute() and released with
+ * free_program().
+ *
+ *   c0_builder *b = c0_builder_new();
+ *   uint16_t main_fn = c0_builder_function(b, 0, 1);  // index 0 is main
+ *   c0_builder_begin(b, main_fn);
+ *   c0_label done = c0_builder_label(b);
+ *   c0_emit_byte(b, BIPUSH, 3);
+ *   c0_emit_branch(b, GOTO, done);
+ *   c0_builder_bind(b, done);
+ *   c0_emit(b, RETURN);
+ *   struct bc0_file *bc0 = c0_builder_finish(b);
+ */
+
+#ifndef C0VM_BUILDER_H
+#define C0VM_BUILDER_H
+
+#include <stdint.h>
+
+#include "c0vm.h"
+
+typedef struct c0_builder c0_builder;
+typedef uint32_t c0_label;
+
+c0_builder *c0_builder_new(void);
+
+// Constant pools; both return the operand for ILDC / ALDC
+uint16_t c0_builder_int(c0_builder *b, int32_t x);
+uint16_t c0_builder_string(c0_builder *b, const char *s);
+
+// Native pool entry for a NATIVE_* index (lib/c0vm_c0ffi.h);
+// returns the operand for INVOKENATIVE
+uint16_t c0_builder_native(c0_builder *b, uint16_t num_args,
+                           uint16_t table_index);
+
+// Declares a function and returns its index, the operand for
+// INVOKESTATIC. The first function declared is main.
+uint16_t c0_builder_function(c0_builder *b, uint8_t num_args,
+                             uint8_t num_vars);
+
+// Subsequent emits append to fn's code
+void c0_builder_begin(c0_builder *b, uint16_t fn);
+
+// Labels belong to the function being emitted when they are bound
+c0_label c0_builder_label(c0_builder *b);
+void c0_builder_bind(c0_builder *b, c0_label l);
+
+void c0_emit(c0_builder *b, ubyte op);                     // no operands
+void c0_emit_byte(c0_builder *b, ubyte op, ubyte x);       // <b> <i> <s> <f>
+void c0_emit_index(c0_builder *b, ubyte op, uint16_t c);   // <c1,c2>
+void c0_emit_branch(c0_builder *b, ubyte op, c0_label l);  // <o1,o2>
+
+// Patches branches and frees the builder; every label used must be bound
+struct bc0_file *c0_builder_finish(c0_builder *b);
+
+#endif /* C0VM_BUILDER_H */
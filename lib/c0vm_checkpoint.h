@@ -0,0 +1,48 @@
+/* C0VM checkpoints (c0vm --checkpoint, --restore)
+ * A checkpoint holds everything a running main needs to go on in
+ * another process: the id of the program (c0_program_id), each frame's
+ * function, pc, locals and operand stack, and every block on the heap
+ * with the pointers in it replaced by block and offset. The file is in
+ * native byte order, for a VM with the same word size.
+ *
+ * Checkpoints are taken between slices of execution, on SIGUSR1 or
+ * every so many seconds. The VM forks and the child writes the file
+ * (to FILE.tmp, renamed over FILE when complete) while the parent runs
+ * on, so a checkpoint costs the running program one fork. At most one
+ * child writes at a time; a checkpoint due while it is still busy
+ * waits for the next slice.
+ *
+ * Pointers in locals and on operand stacks are known to be pointers.
+ * Inside heap blocks they are not: any aligned word whose value is the
+ * address of a heap block or a string literal is taken as a pointer to
+ * it, as a conservative garbage collector would. Programs using the
+ * args, curses, file or img libraries keep state outside the heap and
+ * cannot be checkpointed. Neither is the input read so far nor the
+ * output printed since: a restored run reads stdin anew and prints
+ * again what was printed after the checkpoint.
+ */
+
+#ifndef C0VM_CHECKPOINT_H
+#define C0VM_CHECKPOINT_H
+
+#include "c0vm.h"
+
+#define C0_CHECKPOINT_MAGIC "C0VMCKP"   // 8 bytes with the NUL
+#define C0_CHECKPOINT_FORMAT 1
+#define C0_CHECKPOINT_SLICE 1000000     // fuel between checks
+
+struct c0_checkpoint_options {
+  const char *file;           // where checkpoints go, NULL for none
+  double every;               // seconds between them, 0 for SIGUSR1 only
+};
+
+extern struct c0_checkpoint_options c0_checkpoint_options;
+
+// Runs main of bc0 (bound, with c0_output_init done) as execute()
+// does, from the start or, if restore is not NULL, from the checkpoint
+// in that file, and returns its result. Takes checkpoints as the
+// options say. Exits with a message if bc0 cannot be checkpointed or
+// restore is not a checkpoint of it.
+int c0_checkpoint_execute(struct bc0_file *bc0, const char *restore);
+
+#endif /* C0VM_CHECKPOINT_H */
@@ -0,0 +1,127 @@
+/* C0VM contexts
+ * The VM as a library (make libc0vm.a libc0vm.so). A context runs
+ * functions of one loaded program: every call starts on fresh stacks,
+ * allocates from the context's own heap and comes back with a status
+ * instead of exiting on a runtime error. Contexts share nothing but
+ * the program, so threads can call into different contexts at the
+ * same time; a context is used by one thread at a time.
+ *
+ * A call that fails is unwound: its frames are freed, and so is the
+ * context's heap, since the objects from earlier calls may now point
+ * into what the failed call allocated. c0_vm_fault says where it
+ * stopped, and the context is ready for the next call.
+ *
+ *   c0_vm *vm = c0_vm_open("score.bc0");
+ *   c0_value args[2] = { int2val(3), int2val(4) }, result;
+ *   if (c0_vm_call_name(vm, "score", args, 2, &result) == C0_VM_OK)
+ *     printf("%d\n", val2int(result));
+ *   else
+ *     printf("failed: %s\n", c0_vm_error(vm));
+ *   c0_vm_free(vm);
+ *
+ * Still process-wide: c0_argc/c0_argv (the args natives), conio's
+ * stdout, and what the C0 libraries allocate or report themselves.
+ */
+
+#ifndef C0VM_CONTEXT_H
+#define C0VM_CONTEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "c0vm.h"
+#include "c0vm_heap.h"
+
+typedef struct c0_vm c0_vm;
+
+// The program arguments the args natives see, shared by all contexts
+extern int c0_argc;
+extern char **c0_argv;
+
+enum c0_vm_status {
+  C0_VM_OK,
+  C0_VM_USER_ERROR,          // error() in C0
+  C0_VM_ASSERTION_FAILURE,
+  C0_VM_MEMORY_ERROR,
+  C0_VM_VALUE_ERROR,
+  C0_VM_ARITH_ERROR,
+  C0_VM_BAD_CALL,            // no such function, wrong argument count,
+                             // or nothing to resume
+  C0_VM_YIELDED,             // c0_vm_resume ran out of fuel
+  C0_VM_BLOCKED              // c0_vm_resume is waiting for input
+};
+
+// Loads a .bc0 file or image for a context of its own; NULL with a
+// message on error
+c0_vm *c0_vm_open(const char *filename);
+
+// A context on bc0 (from c0_load_program), which it shares and which
+// must outlive it; filename is only used for function names and may
+// be NULL. Create the contexts of one program from a single thread.
+// NULL with a message if bc0's natives cannot be bound or one of its
+// functions does not decode.
+c0_vm *c0_vm_new(struct bc0_file *bc0, const char *filename);
+
+void c0_vm_free(c0_vm *vm);
+
+struct bc0_file *c0_vm_program(c0_vm *vm);
+
+// Index of the function called name, -1 if there is none or the
+// program carries no names (images)
+int c0_vm_function(c0_vm *vm, const char *name);
+
+// Calls function fn on nargs arguments; its result goes to *result
+// unless result is NULL
+enum c0_vm_status c0_vm_call(c0_vm *vm, int fn, const c0_value *args,
+                             size_t nargs, c0_value *result);
+enum c0_vm_status c0_vm_call_name(c0_vm *vm, const char *name,
+                                  const c0_value *args, size_t nargs,
+                                  c0_value *result);
+
+// A call in slices, for running many contexts on one thread: start
+// sets it up, and every resume runs it for at most fuel backward
+// branches and calls. Resume returns C0_VM_YIELDED when the fuel runs
+// out, C0_VM_BLOCKED at a readline or eof that has to wait for more
+// captured input (see input_open in lib/c0vm_output.h), and otherwise
+// what c0_vm_call would have. A suspended call goes on from where it
+// stopped; c0_vm_reset abandons it.
+enum c0_vm_status c0_vm_start(c0_vm *vm, int fn, const c0_value *args,
+                              size_t nargs);
+enum c0_vm_status c0_vm_resume(c0_vm *vm, uint64_t fuel, c0_value *result);
+bool c0_vm_suspended(c0_vm *vm);
+
+// What the last call that did not return C0_VM_OK failed with
+const char *c0_vm_error(c0_vm *vm);
+
+// Where and why the last call that did not return C0_VM_OK stopped
+struct c0_vm_fault {
+  enum c0_vm_status status;   // C0_VM_OK if no call has failed
+  const char *message;        // as c0_vm_error
+  int function;               // the function it was in, -1 for a bad call
+  const char *function_name;  // NULL if unknown
+  uint32_t pc;                // of the failing instruction in function
+  ubyte opcode;               // INVOKENATIVE if a native failed
+  unsigned depth;             // calls below the one the host made
+};
+
+void c0_vm_fault(c0_vm *vm, struct c0_vm_fault *fault);
+
+// Instructions executed by all calls so far
+uint64_t c0_vm_instructions(c0_vm *vm);
+
+// Caps the bytes the context's heap may hold, objects, arrays, native
+// strings and frames alike, 0 for no limit; it starts with
+// c0_heap_options.limit. A call that would go over fails with
+// C0_VM_MEMORY_ERROR and resets the heap like any other failed call.
+void c0_vm_set_heap_limit(c0_vm *vm, size_t bytes);
+
+// What the context's heap holds now and at most, and has allocated in
+// all, for packing contexts onto a host
+void c0_vm_heap_stats(c0_vm *vm, struct c0_heap_stats *stats);
+
+// Frees everything the program allocated, including what earlier
+// results point to, and abandons a suspended call
+void c0_vm_reset(c0_vm *vm);
+
+#endif /* C0VM_CONTEXT_H */
@@ -0,0 +1,30 @@
+/* C0VM debug info
+ * cc0 -b annotates the bytecode with comments: every function body is
+ * preceded by "#<name>" and every native pool entry ends in "# name".
+ * The loader throws those away, so we recover them from the text.
+ */
+
+#ifndef C0VM_DEBUG_H
+#define C0VM_DEBUG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct c0_debug_info {
+  uint16_t function_count;
+  char **function_names;   // NULL entries where the file had no name
+  uint16_t native_count;
+  char **native_names;
+};
+
+// Never fails: missing or unreadable files give empty name tables
+struct c0_debug_info *c0_debug_load(const char *filename);
+void c0_debug_free(struct c0_debug_info *dbg);
+
+// Writes a printable name to buf, falling back to "fn#<idx>"
+const char *c0_function_name(struct c0_debug_info *dbg, uint16_t idx,
+                             char *buf, size_t len);
+const char *c0_native_name(struct c0_debug_info *dbg, uint16_t idx,
+                           char *buf, size_t len);
+
+#endif /* C0VM_DEBUG_H */
@@ -0,0 +1,34 @@
+/* C0VM runtime errors
+ * The c0_*_error functions come with the course-provided c0vm_abort
+ * object. The Makefile links with -Wl,--wrap for each of them, so the
+ * VM's calls reach the __wrap_ versions in c0vm_errors.c first, which
+ * run our hooks and then hand over to the real ones, unless a VM
+ * context has set a trap to catch the error instead.
+ */
+
+#ifndef C0VM_ERRORS_H
+#define C0VM_ERRORS_H
+
+#include <setjmp.h>
+
+enum c0_error_kind {
+  C0_ERROR_USER,        // c0_user_error, error() in C0
+  C0_ERROR_ASSERTION,   // c0_assertion_failure
+  C0_ERROR_MEMORY,      // c0_memory_error
+  C0_ERROR_VALUE,       // c0_value_error
+  C0_ERROR_ARITH        // c0_arith_error
+};
+
+// A runtime error on a thread with a trap set longjmps to env instead
+// of reporting the error and exiting, with kind and message filled in
+struct c0_trap {
+  jmp_buf env;
+  enum c0_error_kind kind;
+  char message[256];
+};
+
+// Sets the calling thread's trap (NULL to exit on errors again) and
+// returns the previous one
+struct c0_trap *c0_set_trap(struct c0_trap *trap);
+
+#endif /* C0VM_ERRORS_H */
@@ -0,0 +1,84 @@
+/* C0VM execution state
+ * execute() runs main to completion; c0_execute runs any function on
+ * given arguments and keeps the state it allocates where its caller
+ * can find it, so a call that was abandoned by a runtime error (see
+ * c0_set_trap in c0vm_errors.h) can be cleaned up afterwards.
+ *
+ * The same state lets a call stop and be resumed: c0_exec_start sets
+ * it up, and each c0_exec_run goes on until the function returns, its
+ * fuel runs out or a native would block. Fuel is spent one unit per
+ * backward branch and per call, the only ways to run for long.
+ */
+
+#ifndef C0VM_EXEC_H
+#define C0VM_EXEC_H
+
+#include "c0vm.h"
+#include "c0v_stack.h"
+#include "stack.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_recorder.h"
+
+#define C0_FUEL_UNLIMITED UINT64_MAX
+
+enum c0_exec_state {
+  C0_EXEC_DONE,                   // returned, with the result
+  C0_EXEC_OUT_OF_FUEL,
+  C0_EXEC_BLOCKED                 // at an INVOKENATIVE that would block
+};
+
+struct c0_exec {
+  struct bc0_file *bc0;
+  struct c0_recorder *recorder;   // gets every executed instruction
+  native_fn **natives;            // from c0_natives_resolve(bc0)
+  // If not NULL, asked before every native call whether the native
+  // with this table index would block; c0_exec_run stops there if so
+  bool (*would_block)(uint16_t table_index);
+
+  /* Owned by c0_execute while it runs, or between c0_exec_runs */
+  c0v_stack_t S;                  // operand stack of the innermost frame
+  c0_value *V;                    // its locals
+  gstack_t call_stack;            // the frames of its callers
+  size_t pc;                      // where a stopped run goes on
+  uint16_t fn;
+  size_t depth;
+  uint64_t fuel;                  // left for the next c0_exec_run
+  unsigned prof_prev;             // opcode before pc, for the profile
+  size_t frame_credit;            // frame bytes charged to the heap
+                                  // but not used by a frame
+};
+
+// Runs function fn of exec->bc0 on its num_args arguments in args and
+// returns its result
+c0_value c0_execute(struct c0_exec *exec, uint16_t fn, c0_value *args);
+
+// Sets up a call of fn on args for c0_exec_run
+void c0_exec_start(struct c0_exec *exec, uint16_t fn, c0_value *args);
+
+// Runs the started call on exec->fuel; the result goes to *result when
+// it returns C0_EXEC_DONE
+enum c0_exec_state c0_exec_run(struct c0_exec *exec, c0_value *result);
+
+// Frees what a c0_execute or c0_exec_run that did not return left in
+// exec
+void c0_exec_unwind(struct c0_exec *exec);
+
+// One frame of a stopped call. pc is where the function stopped, at
+// the INVOKESTATIC in all but the innermost frame.
+struct c0_exec_frame {
+  uint16_t fn;
+  size_t pc;
+  c0_value *V;                    // fn's num_vars locals
+  c0v_stack_t S;
+};
+
+// The frames of the call stopped in exec, outermost first; they stay
+// exec's. Returns how many, *frames being the caller's to free.
+size_t c0_exec_frames(struct c0_exec *exec, struct c0_exec_frame **frames);
+
+// Sets exec up to go on from count frames like those above, which it
+// takes over, for c0_exec_run; the frames count against the heap
+void c0_exec_restore(struct c0_exec *exec, struct c0_exec_frame *frames,
+                     size_t count);
+
+#endif /* C0VM_EXEC_H */
@@ -0,0 +1,27 @@
+/* C0VM call-graph timing
+ * Keeps a shadow call stack of C0 functions and natives, timestamps
+ * every entry and exit, and accumulates inclusive and exclusive time
+ * per call path. The report is folded-stack text for flamegraph.pl.
+ */
+
+#ifndef C0VM_FLAME_H
+#define C0VM_FLAME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c0vm_debug.h"
+
+extern bool c0_flame_enabled;
+
+void c0_flame_enter(uint16_t fn);            // INVOKESTATIC, and main
+void c0_flame_enter_native(uint16_t native); // INVOKENATIVE
+void c0_flame_exit(void);                    // RETURN, or native return
+
+// One line per call path with its exclusive time in nanoseconds.
+// Frames still open (the run ended in an error) are closed first.
+void c0_flame_report(FILE *out, struct c0_debug_info *dbg);
+void c0_flame_free(void);
+
+#endif /* C0VM_FLAME_H */
@@ -0,0 +1,28 @@
+/* C0VM fork server (c0vm --fork-server)
+ * Runs a program up to its first call of one native, by default
+ * readline, and keeps it there as a snapshot. Every connection to the
+ * Unix socket then forks the stopped VM, so the job shares the heap
+ * built so far copy-on-write and only runs the rest of main. The job
+ * has the connection as stdin, stdout and stderr: the client writes
+ * its input, shuts down its side for writing and reads everything c0vm
+ * would print, the result line included, until the job closes it.
+ *
+ * Any native can serve as an explicit marker, e.g. a flush() right
+ * after initialization with --snapshot-at=flush.
+ */
+
+#ifndef C0VM_FORKSERVER_H
+#define C0VM_FORKSERVER_H
+
+#include <stdbool.h>
+
+#include "c0vm.h"
+
+// Arms the snapshot for bc0 (bound, with c0_output_init done), whose
+// native pool must name the native at in filename's comments. Listens
+// on socket_path right away; the server runs inside the first call of
+// at and exits on SIGINT or SIGTERM. False with a message on error.
+bool c0_fork_server_init(struct bc0_file *bc0, const char *filename,
+                         const char *at, const char *socket_path);
+
+#endif /* C0VM_FORKSERVER_H */
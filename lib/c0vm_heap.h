@@ -0,0 +1,110 @@
+/* C0VM heap
+ * Backing storage for C0 cells and arrays. Cells and small arrays
+ * come from calloc; arrays above a threshold get their own anonymous
+ * mapping, which the kernel zeroes on first touch, optionally backed
+ * by transparent huge pages.
+ *
+ * Every heap counts the bytes it holds: objects, arrays, the strings
+ * natives return and the frames of calls in progress. A heap with a
+ * limit raises a C0 memory error instead of going over it, as it does
+ * when the system is out of memory.
+ */
+
+#ifndef C0VM_HEAP_H
+#define C0VM_HEAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "c0vm.h"
+
+enum c0_hugepage_policy {
+  C0_HUGEPAGES_NEVER,    // plain 4K pages
+  C0_HUGEPAGES_MADVISE   // MADV_HUGEPAGE on large array mappings
+};
+
+struct c0_heap_options {
+  size_t mmap_threshold;               // bytes; 0 disables the mmap path
+  enum c0_hugepage_policy hugepages;
+  bool track;                          // remember allocations for reset
+  size_t limit;                        // bytes a new heap may hold,
+                                       // 0 for no limit
+};
+
+struct c0_heap_stats {
+  size_t live;            // bytes held now
+  size_t peak;            // most bytes held at once since the heap was made
+  size_t limit;           // 0 if none
+  uint64_t allocated;     // bytes ever allocated, for allocation rates
+  uint64_t allocations;
+};
+
+extern struct c0_heap_options c0_heap_options;
+
+// Parses "never" or "madvise"; returns false on anything else
+bool c0_parse_hugepage_policy(const char *s, enum c0_hugepage_policy *out);
+
+// Returns zeroed storage for a NEW cell or an array header (never NULL)
+void *c0_object_alloc(size_t bytes);
+
+// Returns zeroed storage for n elements of size s (never NULL)
+void *c0_array_alloc(size_t n, size_t s);
+
+// Counts bytes held outside the functions above, e.g. a call frame,
+// against the heap, raising a memory error if they go over its limit
+void c0_heap_charge(size_t bytes);
+
+// Gives back bytes counted by c0_heap_charge
+void c0_heap_uncharge(size_t bytes);
+
+// Sets the calling thread's heap's limit in bytes, 0 for none; what it
+// holds already is not checked
+void c0_heap_set_limit(size_t bytes);
+
+void c0_heap_stats(struct c0_heap_stats *stats);
+
+// Bytes a native allocated for its result, or 0 if it returns no
+// fresh heap object (see the string, parse and conio natives)
+size_t c0_native_alloc_size(uint16_t table_index, c0_value result);
+
+// Counts a native's result against the heap like c0_heap_charge and,
+// while tracking, remembers where it is. Boxed ints and doubles are
+// taken over and freed by c0_heap_reset; strings and arrays are left
+// alone, since a native may return a literal or one of its arguments.
+// Returns c0_native_alloc_size.
+size_t c0_heap_native_result(uint16_t table_index, c0_value result);
+
+struct c0_heap_block {
+  void *base;
+  size_t bytes;
+};
+
+// Everything the calling thread's heap holds, which must be tracking:
+// the blocks it allocated and those natives returned, in no order.
+// *count of them; the caller frees the array.
+struct c0_heap_block *c0_heap_blocks(size_t *count);
+
+// Unmaps every large array still alive
+void c0_heap_release(void);
+
+// Frees everything allocated since tracking was turned on or the last
+// reset, so a program can be run again from a clean heap, including
+// the boxed results of natives. Strings and arrays made by natives are
+// not reclaimed, but they no longer count as live.
+void c0_heap_reset(void);
+
+// A heap of its own for a VM context: it always tracks, so freeing it
+// frees everything allocated in it
+struct c0_heap;
+struct c0_heap *c0_heap_new(void);
+
+// Makes the calling thread allocate from h, or from the process heap
+// if h is NULL; returns the heap it used before. Everything above
+// works on the calling thread's heap.
+struct c0_heap *c0_heap_use(struct c0_heap *h);
+
+// Frees h and everything allocated in it; h must not be in use
+void c0_heap_free(struct c0_heap *h);
+
+#endif /* C0VM_HEAP_H */
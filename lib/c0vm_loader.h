@@ -0,0 +1,100 @@
+/* C0VM program loader
+ * Replaces read_program. A loaded program is one contiguous block in
+ * the image layout below, and the pools and function bodies of the
+ * bc0_file point straight into it. A .bc0 text file is decoded into
+ * a fresh block; an image written by c0_write_image is mapped
+ * read-only and used in place, so loading one costs the same however
+ * large the program is.
+ *
+ * Without the cache, function bodies of a text file are decoded on
+ * first call rather than at load time.
+ *
+ * Decoded text files are also kept in a cache directory, named by a
+ * hash of the text and the VM build, so the next run of the same
+ * program maps the cached image instead of decoding again.
+ *
+ * Image layout (native byte order, sections 8-byte aligned):
+ *   struct c0_image_header
+ *   int32_t               ints[int_count]
+ *   struct native_info    natives[native_count]
+ *   struct c0_image_fn    functions[function_count]
+ *   char                  strings[string_count]
+ *   ubyte                 code[]
+ */
+
+#ifndef C0VM_LOADER_H
+#define C0VM_LOADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "c0vm.h"
+
+#define C0_IMAGE_MAGIC "C0VMIMG"      // 8 bytes with the NUL
+#define C0_IMAGE_FORMAT 2
+#define C0_IMAGE_BYTE_ORDER 0x01020304
+
+struct c0_image_header {
+  char magic[8];
+  uint32_t format;
+  uint32_t byte_order;        // C0_IMAGE_BYTE_ORDER as written
+  uint32_t bc0_magic;         // as in the .bc0 file
+  uint16_t bc0_version;
+  uint16_t int_count;
+  uint16_t string_count;
+  uint16_t function_count;
+  uint16_t native_count;
+  uint16_t reserved;
+  uint64_t source_hash;       // of the .bc0 text, 0 if not recorded
+  uint64_t build_id;          // c0_build_id() of the VM that decoded it
+  uint64_t int_offset;        // offsets are from the start of the image
+  uint64_t native_offset;
+  uint64_t function_offset;
+  uint64_t string_offset;
+  uint64_t code_offset;
+  uint64_t size;              // of the whole image
+};
+
+struct c0_image_fn {
+  uint8_t num_args;
+  uint8_t num_vars;
+  uint16_t code_length;
+  uint32_t code_offset;       // from code_offset in the header
+};
+
+struct c0_loader_options {
+  bool cache;                 // look up and store decoded .bc0 files
+  const char *cache_dir;      // NULL: $XDG_CACHE_HOME/c0vm or ~/.cache/c0vm
+};
+
+extern struct c0_loader_options c0_loader_options;
+
+// Identifies this VM build; cached images from other builds are ignored
+uint64_t c0_build_id(void);
+
+// Reads a .bc0 text file or an image; on error prints a message and
+// returns NULL
+struct bc0_file *c0_load_program(const char *filename);
+
+// Decodes function fn on first use and returns its code. Only programs
+// from c0_load_program can have functions whose code is still NULL.
+// A body that does not decode raises c0_memory_error.
+ubyte *c0_load_function(struct bc0_file *bc0, uint16_t fn);
+
+// Decodes every function not decoded yet; false with a message if one
+// does not decode. Afterwards bc0 is no longer written to and can be
+// shared between threads.
+bool c0_load_all_functions(struct bc0_file *bc0);
+
+// Identifies a program by its pools and code, the same whether it was
+// loaded from text or an image; decodes every function
+uint64_t c0_program_id(struct bc0_file *bc0);
+
+// Releases a program returned by c0_load_program
+void c0_free_program(struct bc0_file *bc0);
+
+// Writes bc0 (from c0_load_program) as an image; false with a message
+// on error
+bool c0_write_image(struct bc0_file *bc0, const char *filename);
+
+#endif /* C0VM_LOADER_H */
@@ -0,0 +1,54 @@
+/* C0VM memoization (c0vm --memo)
+ * At load, c0_memo_init marks the functions that only compute on
+ * their arguments: no instruction in them touches the heap, calls a
+ * native or takes an address, and every function they call is marked
+ * too. A call of one of them with int arguments that returns an int
+ * always returns the same int, so each gets a table of results keyed
+ * on its arguments, consulted at INVOKESTATIC.
+ *
+ * Tables are direct-mapped with a fixed number of entries, allocated
+ * at the function's first call; a new result replaces whatever had its
+ * slot. Calls with a pointer argument, and results that are pointers
+ * (a string literal, NULL), go past the table.
+ */
+
+#ifndef C0VM_MEMO_H
+#define C0VM_MEMO_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c0vm.h"
+#include "c0vm_debug.h"
+
+#define C0_MEMO_DEFAULT 4096           // entries per function
+#define C0_MEMO_SLOT_BITS 20
+#define C0_MEMO_MAX ((size_t)1 << C0_MEMO_SLOT_BITS)
+
+extern bool c0_memo_enabled;
+
+// Finds the pure functions of bc0, loading every function; entries is
+// rounded up to a power of two no larger than C0_MEMO_MAX
+void c0_memo_init(struct bc0_file *bc0, size_t entries);
+
+// At a call of fn with args: true with its *result if it is known.
+// Otherwise *ticket is for c0_memo_store when the call returns, or 0
+// if this call is not memoized.
+bool c0_memo_lookup(uint16_t fn, c0_value *args, c0_value *result,
+                    uint64_t *ticket);
+
+// Keeps the result of the call that got ticket, unless its slot has
+// been taken since
+void c0_memo_store(uint16_t fn, uint64_t ticket, c0_value result);
+
+// Pure functions with their calls and hit rates, most calls first
+void c0_memo_report(FILE *out, struct c0_debug_info *dbg);
+
+// Forgets every result and count, keeping which functions are pure
+void c0_memo_reset(void);
+
+void c0_memo_free(void);
+
+#endif /* C0VM_MEMO_H */
@@ -0,0 +1,35 @@
+/* C0VM native libraries
+ * c0vm is not linked against the C0 libraries. Before a program runs,
+ * the groups of natives it uses (the sections of c0vm_c0ffi.h: args,
+ * conio, curses, ...) are worked out from its native pool and only
+ * those libraries are dlopen'ed. The ffi wrappers, in libc0ffi.so,
+ * bind to them on first call through the PLT.
+ */
+
+#ifndef C0VM_NATIVE_LIBS_H
+#define C0VM_NATIVE_LIBS_H
+
+#include <stdbool.h>
+
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+// Loads the library of every native group bc0 refers to, then the
+// wrappers; false with a message if one cannot be loaded
+bool c0_natives_bind(struct bc0_file *bc0);
+
+// Loads every C0 library, as linking against all of them used to
+bool c0_natives_bind_all(void);
+
+// native_function_table from libc0ffi.so, loaded on first use; NULL
+// with a message if it cannot be loaded
+native_fn **c0_natives_table(void);
+
+// The native_function_table entry of each native pool entry of bc0,
+// indexed like native_pool, after c0_natives_bind; the caller frees it
+native_fn **c0_natives_resolve(struct bc0_file *bc0);
+
+// Number of C0 libraries loaded so far
+unsigned c0_natives_loaded(void);
+
+#endif /* C0VM_NATIVE_LIBS_H */
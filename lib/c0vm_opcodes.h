@@ -0,0 +1,22 @@
+/* C0VM opcode table
+ * Mnemonics and instruction lengths, for reports and disassembly.
+ */
+
+#include <stddef.h>
+
+#ifndef C0VM_OPCODES_H
+#define C0VM_OPCODES_H
+
+#include "c0vm.h"
+
+// Lowercase mnemonic as in c0vm-ref.txt, or NULL for invalid opcodes
+const char *c0_opcode_name(ubyte op);
+
+// Length in bytes including operands, or 0 for invalid opcodes
+unsigned c0_opcode_length(ubyte op);
+
+// Writes "mnemonic operands" for the instruction at code[pc] into buf
+void c0_disassemble(struct bc0_file *bc0, ubyte *code, size_t code_length,
+                    size_t pc, char *buf, size_t len);
+
+#endif /* C0VM_OPCODES_H */
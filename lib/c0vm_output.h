@@ -0,0 +1,65 @@
+/* C0VM output buffer
+ * print, println, printint, printchar and printbool write into one
+ * VM-owned buffer instead of going through the conio library, which
+ * may write on every call. The buffer goes out with a single writev
+ * when it fills (together with the string that did not fit), and is
+ * flushed by flush, readline and eof, before runtime errors and at
+ * exit. On a terminal it is also flushed at every newline.
+ * c0vm-batch and --serve capture output (and --serve also the input)
+ * per thread instead.
+ * print_dub, print_fpt, print_hex and print_int still print through
+ * stdio; the buffer is flushed before each of them, and under capture
+ * they are a value error.
+ */
+
+#ifndef C0VM_OUTPUT_H
+#define C0VM_OUTPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "c0vm.h"
+
+#define C0_OUTPUT_DEFAULT ((size_t)1 << 20)
+
+struct c0_output_options {
+  size_t buffer_size;         // bytes; 0 leaves the conio natives alone
+};
+
+extern struct c0_output_options c0_output_options;
+
+// Whether bc0 calls any curses native
+bool c0_output_uses_curses(struct bc0_file *bc0);
+
+// Installs the buffered natives in native_function_table, unless the
+// buffer size is 0 or bc0 uses curses, which writes to the terminal
+// itself; NULL skips the curses check
+void c0_output_init(struct bc0_file *bc0);
+
+// Output collected in memory, see c0_output_capture
+struct c0_output_capture {
+  char *data;                 // not NUL-terminated
+  size_t len;
+  size_t capacity;
+  const char *input;          // if not NULL, what readline and eof read
+  size_t input_len;
+  size_t input_pos;
+  bool input_open;            // more input may be appended; see below
+};
+
+// Sends the calling thread's print output to cap instead of stdout,
+// or back to stdout if cap is NULL; flush does nothing while captured
+void c0_output_capture(struct c0_output_capture *cap);
+
+// Whether the native at table_index has to wait for more input: a
+// readline without a whole line left or an eof at the end of input,
+// while the calling thread's capture has input_open set
+bool c0_output_would_block(uint16_t table_index);
+
+// Writes out anything buffered; safe to call at any time
+void c0_output_flush(void);
+
+// Flushes and releases the buffer
+void c0_output_free(void);
+
+#endif /* C0VM_OUTPUT_H */
@@ -0,0 +1,36 @@
+/* C0VM hardware counters per function
+ * Reads perf_event_open counters (cycles, instructions, branch-misses,
+ * LLC-misses) whenever control moves between C0 functions and charges
+ * the deltas to the function that was running. Natives are charged to
+ * their caller. Without PMU access it falls back to software counters,
+ * and without perf_event_open at all to thread CPU time.
+ */
+
+#ifndef C0VM_PERF_H
+#define C0VM_PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c0vm.h"
+#include "c0vm_debug.h"
+
+extern bool c0_perf_enabled;
+
+// Opens the counters; prints which set it got to stderr
+void c0_perf_init(struct bc0_file *bc0);
+
+// Charges counts since the last switch to fn
+void c0_perf_switch(uint16_t fn);
+void c0_perf_call(uint16_t callee);
+
+// Zeroes the totals and calls and counts from now on
+void c0_perf_reset(void);
+
+// Table sorted by the first counter, with IPC and misses per
+// thousand instructions where those counters exist
+void c0_perf_report(FILE *out, struct c0_debug_info *dbg);
+void c0_perf_free(void);
+
+#endif /* C0VM_PERF_H */
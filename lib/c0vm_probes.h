@@ -0,0 +1,26 @@
+/* C0VM static tracepoints
+ * USDT probes for bpftrace, perf and SystemTap. Built with -DC0VM_USDT
+ * when <sys/sdt.h> is available (the Makefile checks); each probe is a
+ * single nop in the instruction stream until a tracer attaches.
+ *
+ *   c0vm:function__entry(fn, depth)    INVOKESTATIC, and main
+ *   c0vm:function__return(fn, depth)   RETURN
+ *   c0vm:native__entry(native, table)  INVOKENATIVE, pool and table index
+ *   c0vm:native__return(native, table)
+ *   c0vm:alloc(kind, bytes)            NEW / NEWARRAY, kind from
+ *                                      enum c0_alloc_kind
+ *   c0vm:error(kind, message)          c0_*_error, kind from
+ *                                      enum c0_error_kind
+ */
+
+#ifndef C0VM_PROBES_H
+#define C0VM_PROBES_H
+
+#ifdef C0VM_USDT
+#include <sys/sdt.h>
+#define C0VM_PROBE2(name, a, b) DTRACE_PROBE2(c0vm, name, a, b)
+#else
+#define C0VM_PROBE2(name, a, b) ((void)0)
+#endif
+
+#endif /* C0VM_PROBES_H */
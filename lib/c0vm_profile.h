@@ -0,0 +1,52 @@
+/* C0VM execution profiler
+ * Exact counts of executed opcodes, opcode pairs, instructions and
+ * calls per function, and calls per native.
+ */
+
+#ifndef C0VM_PROFILE_H
+#define C0VM_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c0vm.h"
+#include "c0vm_debug.h"
+
+#define C0_PROFILE_START 256   // "previous opcode" before the first one
+
+struct c0_profile {
+  uint64_t pairs[C0_PROFILE_START + 1][256];  // [previous][current]
+  uint16_t function_count;
+  uint64_t *fn_instrs;      // instructions executed in each function
+  uint64_t *fn_calls;
+  uint16_t native_count;
+  uint64_t *native_calls;   // indexed by native_pool index
+  uint64_t mark;            // instruction count at the last switch
+};
+
+extern bool c0_profile_enabled;
+extern struct c0_profile c0_profile;
+
+void c0_profile_init(struct bc0_file *bc0);
+
+// The one counter bumped per dispatch; prev is the caller's register
+static inline void c0_profile_op(unsigned *prev, ubyte op) {
+  c0_profile.pairs[*prev][op]++;
+  *prev = op;
+}
+
+// Charges instructions executed since the last switch to fn
+static inline void c0_profile_switch(uint16_t fn, uint64_t icount) {
+  c0_profile.fn_instrs[fn] += icount - c0_profile.mark;
+  c0_profile.mark = icount;
+}
+
+// Zeroes every count, as before the first run
+void c0_profile_reset(void);
+
+void c0_profile_report(FILE *out, struct bc0_file *bc0,
+                       struct c0_debug_info *dbg);
+void c0_profile_free(void);
+
+#endif /* C0VM_PROFILE_H */
@@ -0,0 +1,61 @@
+/* C0VM flight recorder
+ * A ring buffer of the last N executed instructions, written on every
+ * dispatch in both builds and dumped in disassembled form when the
+ * program dies with a C0 runtime error or a fatal signal.
+ */
+
+#ifndef C0VM_RECORDER_H
+#define C0VM_RECORDER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "c0vm.h"
+#include "c0vm_debug.h"
+
+#define C0_RECORDER_DEFAULT 256
+
+struct c0_record {
+  uint32_t pc;
+  uint16_t fn;
+  ubyte opcode;
+  ubyte depth;      // call depth, saturating at 255
+};
+
+struct c0_recorder {
+  struct c0_record *ring;
+  uint64_t mask;    // size - 1; the size is a power of two
+  uint64_t next;    // records written so far, i.e. instructions executed
+  struct bc0_file *program;
+  const char *filename;   // for function names in dumps
+};
+
+extern struct c0_recorder c0_recorder;
+
+// c0vmd --trace: also print every instruction as it is dispatched
+extern bool c0_trace_enabled;
+
+// Sizes the ring to at least n records (0 turns dumps off) and
+// installs the fatal signal handlers
+void c0_recorder_init(size_t n);
+void c0_recorder_attach(struct bc0_file *bc0, const char *filename);
+
+// execute() records into c0_recorder, VM contexts into their own
+static inline void c0_record(struct c0_recorder *rec, uint16_t fn, size_t pc,
+                             ubyte op, size_t depth) {
+  struct c0_record *r = &rec->ring[rec->next++ & rec->mask];
+  r->pc = (uint32_t) pc;
+  r->fn = fn;
+  r->opcode = op;
+  r->depth = depth > 255 ? 255 : (ubyte) depth;
+}
+
+// Oldest first; dbg may be NULL
+void c0_recorder_dump(FILE *out, struct c0_debug_info *dbg);
+
+// Dump to stderr with function names, for the runtime error path
+void c0_recorder_dump_on_error(void);
+void c0_recorder_free(void);
+
+#endif /* C0VM_RECORDER_H */
@@ -0,0 +1,45 @@
+/* C0VM server mode (c0vm --serve)
+ * Loads a program once and runs its main for each request, on one
+ * context that is reset in between, instead of one c0vm process per
+ * run. Requests are read from stdin or from the connections to a Unix
+ * socket, one connection at a time, any number per connection.
+ *
+ * All integers are 32 bits, little-endian. A request is
+ *
+ *   argc, then argc times: length, bytes     the arguments main sees
+ *   length, bytes                             what readline and eof read
+ *
+ * and its response is
+ *
+ *   status      enum c0_vm_status
+ *   result      main's result, 0 unless status is C0_VM_OK
+ *   length, bytes                             the printed output
+ *   length, bytes                             the error message, if any
+ *   length, bytes                             the function it failed in
+ *   pc                                        and where, see c0_vm_fault
+ *
+ * tests/bench/servebench.c is a client.
+ */
+
+#ifndef C0VM_SERVE_H
+#define C0VM_SERVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "c0vm.h"
+
+#define C0_SERVE_MAX_ARGS 4096
+#define C0_SERVE_MAX_BYTES ((uint32_t)1 << 26)   // per argument or input
+
+// Serves requests for bc0 (bound, with c0_output_init done) until stdin
+// ends or, on socket_path (NULL for stdin and stdout), until SIGINT or
+// SIGTERM. filename is argv[0] for the program. Returns false if the
+// program cannot be served or the socket cannot be set up.
+bool c0_serve(struct bc0_file *bc0, char *filename, const char *socket_path);
+
+// A Unix socket listening at path, replacing any file there; -1 with
+// a message on error
+int c0_serve_listen(const char *path);
+
+#endif /* C0VM_SERVE_H */
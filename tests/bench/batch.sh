@@ -0,0 +1,66 @@
+#!/bin/sh
+# Batch throughput benchmark behind `make bench-batch`.
+#
+# usage: tests/bench/batch.sh [-n JOBS] [-t THREADS] [program.bc0]
+#
+# Runs JOBS copies of a program (default tests/bench/hello.c0, compiled
+# with cc0 -b) one c0vm process per job, as a shell loop would, then as
+# one c0vm-batch manifest with 1 and with THREADS worker threads
+# (default: online CPUs), and prints wall time and jobs per second.
+
+VM=${C0VM:-./c0vm}
+BATCH=${C0VM_BATCH:-./c0vm-batch}
+CC0=${CC0:-cc0}
+JOBS=200
+THREADS=$(getconf _NPROCESSORS_ONLN)
+
+while getopts n:t: opt; do
+  case $opt in
+    n) JOBS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    *) sed -n '4p' "$0" | sed 's/^# //' >&2; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ $# -gt 0 ]; then
+  BC0=$1
+else
+  cp "$(dirname "$0")/hello.c0" "$WORK/hello.c0"
+  (cd "$WORK" && "$CC0" -b hello.c0) || exit 2
+  BC0=$WORK/hello.bc0
+fi
+
+i=0
+while [ $i -lt "$JOBS" ]; do
+  echo "$BC0 $i" >> "$WORK/manifest"
+  i=$((i + 1))
+done
+
+# report NAME START END
+report() {
+  awk -v n="$1" -v s="$2" -v e="$3" -v j="$JOBS" 'BEGIN {
+    ms = (e - s) / 1e6
+    printf "%-12s %10.1f %12.1f\n", n, ms, j / (ms / 1000)
+  }'
+}
+
+echo "program: $BC0, $JOBS jobs"
+printf '%-12s %10s %12s\n' mode wall_ms jobs/sec
+
+start=$(date +%s%N)
+while read -r prog arg; do
+  "$VM" "$prog" "$arg" > /dev/null || exit 2
+done < "$WORK/manifest"
+report process "$start" "$(date +%s%N)"
+
+start=$(date +%s%N)
+"$BATCH" --threads=1 "$WORK/manifest" > /dev/null 2>&1 || exit 2
+report batch-1 "$start" "$(date +%s%N)"
+
+start=$(date +%s%N)
+"$BATCH" --threads="$THREADS" "$WORK/manifest" > /dev/null 2>&1 || exit 2
+report "batch-$THREADS" "$start" "$(date +%s%N)"
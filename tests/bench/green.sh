@@ -0,0 +1,61 @@
+#!/bin/sh
+# Green thread latency benchmark behind `make bench-green`.
+#
+# usage: tests/bench/green.sh [-n SHORT] [-l LONG] [-f FUEL]
+#
+# Runs SHORT copies of tests/bench/hello.c0 mixed with LONG copies of
+# tests/bench/fib.c0 (compiled with cc0 -b) in one c0vm-batch worker
+# thread, first one job at a time and then with every job taking turns
+# of FUEL (--green), and prints when the short and the long jobs were
+# done, in ms since the batch started.
+
+BATCH=${C0VM_BATCH:-./c0vm-batch}
+CC0=${CC0:-cc0}
+SHORT=100
+LONG=4
+FUEL=10000
+
+while getopts n:l:f: opt; do
+  case $opt in
+    n) SHORT=$OPTARG ;;
+    l) LONG=$OPTARG ;;
+    f) FUEL=$OPTARG ;;
+    *) sed -n '4p' "$0" | sed 's/^# //' >&2; exit 2 ;;
+  esac
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cp "$(dirname "$0")/hello.c0" "$(dirname "$0")/fib.c0" "$WORK"
+(cd "$WORK" && "$CC0" -b hello.c0 && "$CC0" -b fib.c0) || exit 2
+
+# Every long job is followed by its share of the short ones
+i=0
+while [ $i -lt "$LONG" ]; do
+  echo "$WORK/fib.bc0" >> "$WORK/manifest"
+  j=0
+  while [ $j -lt $((SHORT / LONG)) ]; do
+    echo "$WORK/hello.bc0" >> "$WORK/manifest"
+    j=$((j + 1))
+  done
+  i=$((i + 1))
+done
+
+# report MODE: percentiles of done_ms for short and long jobs
+report() {
+  sed -n 's/.*"program":"[^"]*\/\([a-z]*\)\.bc0".*"done_ms":\([0-9.]*\).*/\1 \2/p' |
+  sort -k1,1 -k2n | awk -v mode="$1" '
+    { t[$1, ++n[$1]] = $2 }
+    function pct(k, p,   r) { r = int((p * n[k] + 99) / 100); return t[k, r < 1 ? 1 : r] }
+    END {
+      printf "%-8s %12.1f %12.1f %12.1f %12.1f\n", mode,
+             pct("hello", 50), pct("hello", 99), pct("fib", 50), pct("fib", 100)
+    }'
+}
+
+echo "$SHORT short and $LONG long jobs on one thread, done_ms"
+printf '%-8s %12s %12s %12s %12s\n' mode short_p50 short_p99 long_p50 long_max
+"$BATCH" --threads=1 "$WORK/manifest" 2> /dev/null | report fifo
+"$BATCH" --threads=1 --green="$((SHORT + LONG))" --fuel="$FUEL" \
+  "$WORK/manifest" 2> /dev/null | report green
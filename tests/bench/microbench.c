@@ -0,0 +1,358 @@
+/* C0VM microbenchmarks, behind `make microbench`
+ *
+ * usage: microbench [-n ITERATIONS] [-r RUNS] [case...]
+ *
+ * Each case is a short, stack-neutral instruction sequence placed in the
+ * body of a counted loop built with the bytecode builder, so no cc0 is
+ * needed. The loop is timed under execute() RUNS times and the fastest
+ * run is kept. "ns" is the time per iteration with the empty loop
+ * subtracted; "net" also subtracts the case named under "ref", which
+ * runs the same surrounding loads and pops without the instruction
+ * being measured.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../../lib/c0vm.h"
+#include "../../lib/c0vm_c0ffi.h"
+#include "../../lib/c0vm_builder.h"
+#include "../../lib/c0vm_natives.h"
+#include "../../lib/c0vm_context.h"
+
+/* Locals of main, set up before the loop */
+enum { V_I, V_N, V_SEVEN, V_THREE, V_STRING, V_ARRAY, V_CELL, V_COUNT };
+
+struct ids {
+  uint16_t leaf0;       // int leaf0()          { return 0; }
+  uint16_t leaf2;       // int leaf2(int, int)  { return x + y; }
+  uint16_t strlen;      // string_length
+};
+
+typedef struct {
+  const char *name;
+  const char *ref;      // case to subtract for "net", or NULL
+  unsigned divisor;     // runs ITERATIONS / divisor times (allocations)
+  ubyte op;             // for the cases that share an emitter
+  void (*body)(c0_builder *b, struct ids *ids, ubyte op);
+} bench;
+
+static void empty(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) b; (void) ids; (void) op;
+}
+
+static void single(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids;
+  c0_emit(b, op);
+}
+
+static void push_pop(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids;
+  switch (op) {
+  case BIPUSH: c0_emit_byte(b, BIPUSH, 1); break;
+  case VLOAD: c0_emit_byte(b, VLOAD, V_SEVEN); break;
+  case ACONST_NULL: c0_emit(b, ACONST_NULL); break;
+  case ILDC: c0_emit_index(b, ILDC, c0_builder_int(b, 1 << 20)); break;
+  case ALDC: c0_emit_index(b, ALDC, c0_builder_string(b, "micro")); break;
+  }
+  c0_emit(b, POP);
+}
+
+static void load_store(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids; (void) op;
+  c0_emit_byte(b, VLOAD, V_SEVEN);
+  c0_emit_byte(b, VSTORE, V_SEVEN);
+}
+
+// Two ints in, op, one int out and popped; op == POP pops both instead
+static void binary(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids;
+  c0_emit_byte(b, VLOAD, V_SEVEN);
+  c0_emit_byte(b, VLOAD, V_THREE);
+  c0_emit(b, op);
+  c0_emit(b, POP);
+}
+
+static void dup(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids; (void) op;
+  c0_emit_byte(b, VLOAD, V_SEVEN);
+  c0_emit(b, DUP);
+  c0_emit(b, POP);
+  c0_emit(b, POP);
+}
+
+static void swap(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids; (void) op;
+  c0_emit_byte(b, VLOAD, V_SEVEN);
+  c0_emit_byte(b, VLOAD, V_THREE);
+  c0_emit(b, SWAP);
+  c0_emit(b, POP);
+  c0_emit(b, POP);
+}
+
+// Taken and untaken branches both land on the next instruction
+static void branch(c0_builder *b, struct ids *ids, ubyte taken) {
+  (void) ids;
+  c0_label next = c0_builder_label(b);
+  c0_emit_byte(b, VLOAD, taken ? V_THREE : V_SEVEN);
+  c0_emit_byte(b, VLOAD, taken ? V_SEVEN : V_THREE);
+  c0_emit_branch(b, IF_ICMPLT, next);
+  c0_builder_bind(b, next);
+}
+
+static void jump(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids; (void) op;
+  c0_label next = c0_builder_label(b);
+  c0_emit_branch(b, GOTO, next);
+  c0_builder_bind(b, next);
+}
+
+static void memory(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids;
+  switch (op) {
+  case IMLOAD:
+    c0_emit_byte(b, VLOAD, V_CELL);
+    c0_emit(b, IMLOAD);
+    c0_emit(b, POP);
+    break;
+  case IMSTORE:
+    c0_emit_byte(b, VLOAD, V_CELL);
+    c0_emit_byte(b, VLOAD, V_SEVEN);
+    c0_emit(b, IMSTORE);
+    break;
+  case CMLOAD:
+    c0_emit_byte(b, VLOAD, V_STRING);
+    c0_emit(b, CMLOAD);
+    c0_emit(b, POP);
+    break;
+  case AADDS:
+    c0_emit_byte(b, VLOAD, V_ARRAY);
+    c0_emit_byte(b, VLOAD, V_THREE);
+    c0_emit(b, AADDS);
+    c0_emit(b, POP);
+    break;
+  case ARRAYLENGTH:
+    c0_emit_byte(b, VLOAD, V_ARRAY);
+    c0_emit(b, ARRAYLENGTH);
+    c0_emit(b, POP);
+    break;
+  }
+}
+
+static void call(c0_builder *b, struct ids *ids, ubyte op) {
+  switch (op) {
+  case INVOKESTATIC:
+    c0_emit_index(b, INVOKESTATIC, ids->leaf0);
+    break;
+  case 2:     // two arguments
+    c0_emit_byte(b, VLOAD, V_SEVEN);
+    c0_emit_byte(b, VLOAD, V_THREE);
+    c0_emit_index(b, INVOKESTATIC, ids->leaf2);
+    break;
+  case INVOKENATIVE:
+    c0_emit_byte(b, VLOAD, V_STRING);
+    c0_emit_index(b, INVOKENATIVE, ids->strlen);
+    break;
+  }
+  c0_emit(b, POP);
+}
+
+static void alloc(c0_builder *b, struct ids *ids, ubyte op) {
+  (void) ids;
+  if (op == NEW) {
+    c0_emit_byte(b, NEW, 16);
+  } else {
+    c0_emit_byte(b, BIPUSH, 4);
+    c0_emit_byte(b, NEWARRAY, 4);
+  }
+  c0_emit(b, POP);
+}
+
+static bench benches[] = {
+  { "loop",         NULL,          1, 0,            empty },
+  { "nop",          NULL,          1, NOP,          single },
+  { "bipush+pop",   NULL,          1, BIPUSH,       push_pop },
+  { "vload+pop",    NULL,          1, VLOAD,        push_pop },
+  { "vload+vstore", NULL,          1, 0,            load_store },
+  { "aconst_null",  "bipush+pop",  1, ACONST_NULL,  push_pop },
+  { "ildc",         "bipush+pop",  1, ILDC,         push_pop },
+  { "aldc",         "bipush+pop",  1, ALDC,         push_pop },
+  { "2vload+2pop",  NULL,          1, POP,          binary },
+  { "dup",          "vload+pop",   1, 0,            dup },
+  { "swap",         "2vload+2pop", 1, 0,            swap },
+  { "iadd",         "2vload+2pop", 1, IADD,         binary },
+  { "isub",         "2vload+2pop", 1, ISUB,         binary },
+  { "imul",         "2vload+2pop", 1, IMUL,         binary },
+  { "idiv",         "2vload+2pop", 1, IDIV,         binary },
+  { "irem",         "2vload+2pop", 1, IREM,         binary },
+  { "iand",         "2vload+2pop", 1, IAND,         binary },
+  { "ior",          "2vload+2pop", 1, IOR,          binary },
+  { "ixor",         "2vload+2pop", 1, IXOR,         binary },
+  { "ishl",         "2vload+2pop", 1, ISHL,         binary },
+  { "ishr",         "2vload+2pop", 1, ISHR,         binary },
+  { "if_taken",     "2vload+2pop", 1, 1,            branch },
+  { "if_untaken",   "2vload+2pop", 1, 0,            branch },
+  { "goto",         NULL,          1, 0,            jump },
+  { "imload",       "vload+pop",   1, IMLOAD,       memory },
+  { "imstore",      "2vload+2pop", 1, IMSTORE,      memory },
+  { "cmload",       "vload+pop",   1, CMLOAD,       memory },
+  { "aadds",        "2vload+2pop", 1, AADDS,        memory },
+  { "arraylength",  "vload+pop",   1, ARRAYLENGTH,  memory },
+  { "call0",        "bipush+pop",  1, INVOKESTATIC, call },
+  { "call2",        "2vload+2pop", 1, 2,            call },
+  { "native",       "vload+pop",   1, INVOKENATIVE, call },
+  { "new",          "aconst_null", 16, NEW,         alloc },
+  { "newarray",     "bipush+pop",  16, NEWARRAY,    alloc },
+};
+
+#define NBENCHES (sizeof benches / sizeof benches[0])
+
+static struct bc0_file *build(bench *x, int32_t iterations) {
+  c0_builder *b = c0_builder_new();
+  uint16_t main_fn = c0_builder_function(b, 0, V_COUNT);
+  struct ids ids;
+  ids.leaf0 = c0_builder_function(b, 0, 0);
+  ids.leaf2 = c0_builder_function(b, 2, 2);
+  ids.strlen = c0_builder_native(b, 1, NATIVE_STRING_LENGTH);
+
+  c0_builder_begin(b, ids.leaf0);
+  c0_emit_byte(b, BIPUSH, 0);
+  c0_emit(b, RETURN);
+
+  c0_builder_begin(b, ids.leaf2);
+  c0_emit_byte(b, VLOAD, 0);
+  c0_emit_byte(b, VLOAD, 1);
+  c0_emit(b, IADD);
+  c0_emit(b, RETURN);
+
+  c0_builder_begin(b, main_fn);
+  c0_emit_byte(b, BIPUSH, 7);
+  c0_emit_byte(b, VSTORE, V_SEVEN);
+  c0_emit_byte(b, BIPUSH, 3);
+  c0_emit_byte(b, VSTORE, V_THREE);
+  c0_emit_index(b, ALDC, c0_builder_string(b, "microbench"));
+  c0_emit_byte(b, VSTORE, V_STRING);
+  c0_emit_byte(b, BIPUSH, 8);
+  c0_emit_byte(b, NEWARRAY, 4);
+  c0_emit_byte(b, VSTORE, V_ARRAY);
+  c0_emit_byte(b, NEW, 4);
+  c0_emit_byte(b, VSTORE, V_CELL);
+  c0_emit_byte(b, BIPUSH, 0);
+  c0_emit_byte(b, VSTORE, V_I);
+  c0_emit_index(b, ILDC, c0_builder_int(b, iterations));
+  c0_emit_byte(b, VSTORE, V_N);
+
+  c0_label top = c0_builder_label(b);
+  c0_label done = c0_builder_label(b);
+  c0_builder_bind(b, top);
+  c0_emit_byte(b, VLOAD, V_I);
+  c0_emit_byte(b, VLOAD, V_N);
+  c0_emit_branch(b, IF_ICMPGE, done);
+  x->body(b, &ids, x->op);
+  c0_emit_byte(b, VLOAD, V_I);
+  c0_emit_byte(b, BIPUSH, 1);
+  c0_emit(b, IADD);
+  c0_emit_byte(b, VSTORE, V_I);
+  c0_emit_branch(b, GOTO, top);
+  c0_builder_bind(b, done);
+  c0_emit_byte(b, BIPUSH, 0);
+  c0_emit(b, RETURN);
+
+  return c0_builder_finish(b);
+}
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// Fastest of runs, in nanoseconds per loop iteration
+static double measure(bench *x, int32_t iterations, int runs) {
+  int32_t n = iterations / (int32_t) x->divisor;
+  if (n < 1) n = 1;
+  struct bc0_file *bc0 = build(x, n);
+  if (!c0_natives_bind(bc0)) exit(EXIT_FAILURE);
+  double best = -1;
+  for (int r = 0; r < runs; r++) {
+    double start = now_ns();
+    execute(bc0);
+    double t = (now_ns() - start) / n;
+    if (best < 0 || t < best) best = t;
+  }
+  free_program(bc0);
+  return best;
+}
+
+static bench *find(const char *name) {
+  for (size_t i = 0; i < NBENCHES; i++) {
+    if (strcmp(benches[i].name, name) == 0) return &benches[i];
+  }
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: microbench [-n ITERATIONS] [-r RUNS] [case...]\n");
+  fprintf(stderr, "cases:");
+  for (size_t i = 0; i < NBENCHES; i++) fprintf(stderr, " %s", benches[i].name);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  long iterations = 1000000;
+  int runs = 5;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    if (argi + 1 == argc) usage();
+    if (strcmp(argv[argi], "-n") == 0) {
+      iterations = strtol(argv[++argi], NULL, 10);
+    } else if (strcmp(argv[argi], "-r") == 0) {
+      runs = atoi(argv[++argi]);
+    } else {
+      usage();
+    }
+  }
+  if (iterations < 1 || iterations > INT32_MAX || runs < 1) usage();
+  for (int i = argi; i < argc; i++) {
+    if (find(argv[i]) == NULL) usage();
+  }
+  c0_argc = 0;
+  c0_argv = argv + argc;
+
+  bool selected[NBENCHES], needed[NBENCHES];
+  for (size_t i = 0; i < NBENCHES; i++) {
+    selected[i] = argi == argc;
+    for (int j = argi; j < argc; j++) selected[i] |= &benches[i] == find(argv[j]);
+    needed[i] = selected[i];
+  }
+  for (size_t i = 0; i < NBENCHES; i++) {
+    if (selected[i] && benches[i].ref != NULL)
+      needed[find(benches[i].ref) - benches] = true;
+  }
+
+  // All times are relative to the empty loop; "loop" itself is absolute
+  double loop = measure(&benches[0], (int32_t) iterations, runs);
+  double ns[NBENCHES];
+  printf("%-14s %10s %10s  %s\n", "case", "ns", "net", "ref");
+  for (size_t i = 0; i < NBENCHES; i++) {
+    bench *x = &benches[i];
+    bench *ref = x->ref == NULL ? NULL : find(x->ref);
+    if (!needed[i]) continue;
+
+    ns[i] = i == 0 ? loop : measure(x, (int32_t) iterations, runs) - loop;
+    if (!selected[i]) continue;
+    if (i == 0) {
+      printf("%-14s %10.2f %10s  %s\n", x->name, loop, "", "(absolute)");
+    } else if (ref == NULL) {
+      printf("%-14s %10.2f %10.2f\n", x->name, ns[i], ns[i]);
+    } else {
+      printf("%-14s %10.2f %10.2f  %s\n", x->name, ns[i],
+             ns[i] - ns[ref - benches], ref->name);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Benchmark runner behind `make bench`.
+#
+# usage: tests/bench/run.sh [-n RUNS] [-t PERCENT] [-b BASELINE] [-s] [bench...]
+#
+# Compiles each tests/bench/<bench>.c0 with cc0 -b when the .bc0 is
+# missing or stale, runs it RUNS times under $C0VM (default ./c0vm) and
+# reports the median wall time, instructions per second and peak RSS.
+# Medians are compared against BASELINE and anything slower by more
+# than PERCENT is flagged; the exit status is 1 if anything was. -s
+# writes the medians of this run as the new baseline instead.
+
+VM=${C0VM:-./c0vm}
+CC0=${CC0:-cc0}
+DIR=$(dirname "$0")
+RUNS=5
+THRESHOLD=10
+BASELINE=$DIR/baseline.txt
+SAVE=0
+
+while getopts n:t:b:s opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    t) THRESHOLD=$OPTARG ;;
+    b) BASELINE=$OPTARG ;;
+    s) SAVE=1 ;;
+    *) sed -n '4p' "$0" | sed 's/^# //' >&2; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+# bigarray is left out by default: it needs ~400M of memory
+BENCHES=${*:-"fib sieve nbody bintrees strings sort hashtable print"}
+
+STATS=$(mktemp)
+TIMES=$(mktemp)
+RESULTS=$(mktemp)
+trap 'rm -f "$STATS" "$TIMES" "$RESULTS"' EXIT
+
+printf '%-12s %12s %14s %12s  %s\n' bench median_ms instr/sec peak_rss_kb vs_baseline
+status=0
+for name in $BENCHES; do
+  src=$DIR/$name.c0
+  bc0=$DIR/$name.bc0
+  if [ ! -f "$bc0" ] || [ "$src" -nt "$bc0" ]; then
+    "$CC0" -b "$src" || exit 2   # writes $bc0 next to the source
+  fi
+
+  : > "$TIMES"
+  rss=0
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$VM" --stats="$STATS" "$bc0" > /dev/null || exit 2
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000 )) >> "$TIMES"
+    r=$(sed -n 's/.*maxrss_kb=\([0-9]*\).*/\1/p' "$STATS")
+    [ "$r" -gt "$rss" ] && rss=$r
+    i=$((i + 1))
+  done
+  instructions=$(sed -n 's/.*instructions=\([0-9]*\).*/\1/p' "$STATS")
+  median_us=$(sort -n "$TIMES" | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')
+
+  verdict=-
+  if [ "$SAVE" -eq 0 ] && [ -f "$BASELINE" ]; then
+    verdict=$(awk -v n="$name" -v m="$median_us" -v t="$THRESHOLD" '
+      $1 == n {
+        d = (m / 1000 - $2) / $2 * 100
+        printf "%+.1f%%%s", d, (d > t ? " REGRESSION" : "")
+        found = 1
+      }
+      END { if (!found) print "-" }' "$BASELINE")
+    case $verdict in *REGRESSION*) status=1 ;; esac
+  fi
+
+  awk -v n="$name" -v m="$median_us" -v i="$instructions" -v r="$rss" -v v="$verdict" '
+    BEGIN { printf "%-12s %12.1f %14.0f %12d  %s\n", n, m / 1000, i / (m / 1e6), r, v }'
+  echo "$name $(awk -v m="$median_us" 'BEGIN { printf "%.1f", m / 1000 }')" >> "$RESULTS"
+done
+
+if [ "$SAVE" -eq 1 ]; then
+  cp "$RESULTS" "$BASELINE"
+  echo "baseline written to $BASELINE"
+fi
+exit $status
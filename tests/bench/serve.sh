@@ -0,0 +1,37 @@
+#!/bin/sh
+# Server mode latency benchmark behind `make bench-serve`.
+#
+# usage: tests/bench/serve.sh [-n REQUESTS] [program.bc0 [args...]]
+#
+# Runs a program (default tests/bench/hello.c0, compiled with cc0 -b)
+# REQUESTS times as one c0vm process per run and as requests to one
+# c0vm --serve, and prints latency percentiles (see servebench.c).
+# Without a program it then also times tests/bench/warmstart.c0, whose
+# main is nearly all initialization, against c0vm --fork-server.
+
+VM=${C0VM:-./c0vm}
+SERVEBENCH=${SERVEBENCH:-./servebench}
+CC0=${CC0:-cc0}
+REQUESTS=500
+
+while getopts n: opt; do
+  case $opt in
+    n) REQUESTS=$OPTARG ;;
+    *) sed -n '4p' "$0" | sed 's/^# //' >&2; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ $# -gt 0 ]; then
+  exec "$SERVEBENCH" -n "$REQUESTS" "$VM" "$@"
+fi
+
+cp "$(dirname "$0")/hello.c0" "$(dirname "$0")/warmstart.c0" "$WORK"
+(cd "$WORK" && "$CC0" -b hello.c0 && "$CC0" -b warmstart.c0) || exit 2
+"$SERVEBENCH" -n "$REQUESTS" "$VM" "$WORK/hello.bc0" || exit 2
+echo
+# Every run of the others pays for the whole table
+"$SERVEBENCH" -n 20 -i 1000000 -f readline "$VM" "$WORK/warmstart.bc0"
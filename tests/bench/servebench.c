@@ -0,0 +1,306 @@
+/* C0VM server mode latency, behind `make bench-serve`
+ *
+ * usage: servebench [-n REQUESTS] [-i LINE] [-f NATIVE]
+ *                   c0vm program.bc0 [args...]
+ *
+ * Runs the program REQUESTS times as one `c0vm program.bc0 args...`
+ * process each (fork, exec, wait), then as REQUESTS requests to one
+ * `c0vm --serve program.bc0` over pipes, after one untimed request.
+ * With -f, also as REQUESTS connections to one `c0vm --fork-server
+ * --snapshot-at=NATIVE`. Every run gets LINE and a newline as its
+ * input (default none). Prints the percentiles of the per-run latency
+ * in microseconds. The program's output is discarded.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static char *input = "";         // what every run reads
+
+static double now_us(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted values, as in c0vm --bench */
+static double percentile(double *sorted, int n, int p) {
+  int rank = (p * n + 99) / 100;
+  return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static void report(const char *mode, double *us, int n) {
+  qsort(us, n, sizeof *us, compare_doubles);
+  double sum = 0;
+  for (int i = 0; i < n; i++) sum += us[i];
+  printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", mode,
+         percentile(us, n, 50), percentile(us, n, 90),
+         percentile(us, n, 99), us[n - 1], sum / n);
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(2);
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) die("write");
+    p += w;
+    n -= w;
+  }
+}
+
+/*** fork and exec ***/
+
+static void run_processes(char **argv, double *us, int n) {
+  int devnull = open("/dev/null", O_WRONLY);
+  if (devnull < 0) die("/dev/null");
+  for (int i = 0; i < n; i++) {
+    double start = now_us();
+    int in[2];
+    if (pipe(in) < 0) die("pipe");
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+      dup2(in[0], STDIN_FILENO);
+      dup2(devnull, STDOUT_FILENO);
+      close(in[0]);
+      close(in[1]);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+    close(in[0]);
+    write_all(in[1], input, strlen(input));
+    close(in[1]);
+    int status;
+    if (waitpid(pid, &status, 0) < 0) die("waitpid");
+    us[i] = now_us() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "servebench: %s did not run\n", argv[0]);
+      exit(2);
+    }
+  }
+  close(devnull);
+}
+
+/*** --serve ***/
+
+static void put_u32(char *p, uint32_t x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static uint32_t get_u32(unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void read_all(int fd, void *p, size_t n) {
+  char *c = p;
+  while (n > 0) {
+    ssize_t r = read(fd, c, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      fprintf(stderr, "servebench: server went away\n");
+      exit(2);
+    }
+    c += r;
+    n -= r;
+  }
+}
+
+/* Skips a length-prefixed field of the response */
+static void skip_field(int fd) {
+  unsigned char len[4];
+  read_all(fd, len, 4);
+  uint32_t n = get_u32(len);
+  char chunk[4096];
+  while (n > 0) {
+    uint32_t k = n < sizeof chunk ? n : sizeof chunk;
+    read_all(fd, chunk, k);
+    n -= k;
+  }
+}
+
+/* One request with the arguments after argv[0] and input */
+static char *encode(int argc, char **argv, size_t *len) {
+  size_t n = 8 + strlen(input);
+  for (int i = 1; i < argc; i++) n += 4 + strlen(argv[i]);
+  char *req = malloc(n), *p = req;
+  if (req == NULL) die("malloc");
+  put_u32(p, argc - 1);
+  p += 4;
+  for (int i = 1; i < argc; i++) {
+    size_t k = strlen(argv[i]);
+    put_u32(p, k);
+    memcpy(p + 4, argv[i], k);
+    p += 4 + k;
+  }
+  put_u32(p, strlen(input));
+  memcpy(p + 4, input, strlen(input));
+  *len = n;
+  return req;
+}
+
+static void run_server(char *vm, int argc, char **argv, double *us, int n) {
+  int to[2], from[2];
+  if (pipe(to) < 0 || pipe(from) < 0) die("pipe");
+  pid_t pid = fork();
+  if (pid < 0) die("fork");
+  if (pid == 0) {
+    dup2(to[0], STDIN_FILENO);
+    dup2(from[1], STDOUT_FILENO);
+    close(to[1]);
+    close(from[0]);
+    execl(vm, vm, "--serve", argv[0], (char *) NULL);
+    _exit(127);
+  }
+  close(to[0]);
+  close(from[1]);
+
+  size_t len;
+  char *req = encode(argc, argv, &len);
+  for (int i = -1; i < n; i++) {
+    double start = now_us();
+    write_all(to[1], req, len);
+    unsigned char head[8];
+    read_all(from[0], head, 8);
+    skip_field(from[0]);
+    skip_field(from[0]);
+    skip_field(from[0]);
+    unsigned char pc[4];
+    read_all(from[0], pc, 4);
+    if (i >= 0) us[i] = now_us() - start;
+    if (get_u32(head) != 0) {
+      fprintf(stderr, "servebench: request failed with status %u\n",
+              (unsigned) get_u32(head));
+      exit(2);
+    }
+  }
+  free(req);
+  close(to[1]);
+  close(from[0]);
+  waitpid(pid, NULL, 0);
+}
+
+/*** --fork-server ***/
+
+static int connect_to(struct sockaddr_un *addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) die("socket");
+  if (connect(fd, (struct sockaddr *) addr, sizeof *addr) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void run_fork_server(char **argv, const char *native, double *us,
+                            int n) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof addr.sun_path, "/tmp/servebench.%ld.sock",
+           (long) getpid());
+  char socket_opt[128], at_opt[128];
+  snprintf(socket_opt, sizeof socket_opt, "--fork-server=%s", addr.sun_path);
+  snprintf(at_opt, sizeof at_opt, "--snapshot-at=%s", native);
+
+  pid_t pid = fork();
+  if (pid < 0) die("fork");
+  if (pid == 0) {
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    char **vm_argv = calloc(argc + 3, sizeof *vm_argv);
+    vm_argv[0] = argv[0];
+    vm_argv[1] = socket_opt;
+    vm_argv[2] = at_opt;
+    memcpy(vm_argv + 3, argv + 1, argc * sizeof *vm_argv);
+    execv(argv[0], vm_argv);
+    _exit(127);
+  }
+
+  // Wait for the socket; the first, untimed job waits for the snapshot
+  struct timespec pause = { 0, 10000000 };
+  int fd;
+  for (int tries = 0; (fd = connect_to(&addr)) < 0; tries++) {
+    if (tries == 1000 || waitpid(pid, NULL, WNOHANG) != 0) {
+      fprintf(stderr, "servebench: no fork server on %s\n", addr.sun_path);
+      exit(2);
+    }
+    nanosleep(&pause, NULL);
+  }
+  for (int i = -1; i < n; i++) {
+    double start = now_us();
+    if (i >= 0 && (fd = connect_to(&addr)) < 0) die("connect");
+    write_all(fd, input, strlen(input));
+    shutdown(fd, SHUT_WR);
+    char chunk[4096];
+    while (read(fd, chunk, sizeof chunk) > 0) continue;
+    close(fd);
+    if (i >= 0) us[i] = now_us() - start;
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+  int n = 200;
+  char *native = NULL;
+  int argi = 1;
+  for (; argi + 1 < argc && argv[argi][0] == '-'; argi += 2) {
+    if (strcmp(argv[argi], "-n") == 0) {
+      n = atoi(argv[argi + 1]);
+    } else if (strcmp(argv[argi], "-i") == 0) {
+      size_t len = strlen(argv[argi + 1]);
+      input = malloc(len + 2);
+      if (input == NULL) die("malloc");
+      memcpy(input, argv[argi + 1], len);
+      strcpy(input + len, "\n");
+    } else if (strcmp(argv[argi], "-f") == 0) {
+      native = argv[argi + 1];
+    } else {
+      break;
+    }
+  }
+  if (n < 1 || argc - argi < 2) {
+    fprintf(stderr, "usage: %s [-n REQUESTS] [-i LINE] [-f NATIVE] c0vm"
+            " program.bc0 [args...]\n", argv[0]);
+    return 2;
+  }
+  char *vm = argv[argi];
+  double *us = calloc(n, sizeof *us);
+  if (us == NULL) die("calloc");
+
+  printf("program: %s, %d runs, microseconds\n", argv[argi + 1], n);
+  printf("%-8s %10s %10s %10s %10s %10s\n", "mode", "p50", "p90", "p99",
+         "max", "mean");
+  // argv[argi..] is "c0vm program args..." as it is
+  run_processes(argv + argi, us, n);
+  report("process", us, n);
+  run_server(vm, argc - argi - 1, argv + argi + 1, us, n);
+  report("serve", us, n);
+  if (native != NULL) {
+    run_fork_server(argv + argi, native, us, n);
+    report("fork", us, n);
+  }
+  free(us);
+  return 0;
+}
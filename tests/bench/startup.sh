@@ -0,0 +1,95 @@
+#!/bin/sh
+# Startup benchmark behind `make bench-startup`.
+#
+# usage: tests/bench/startup.sh [-n RUNS] [-f FUNCTIONS] [program.bc0]
+#
+# Without a program, generates a C0 file with FUNCTIONS functions of
+# which main calls one, and compiles it with cc0 -b. Runs it RUNS times
+# under $C0VM (default ./c0vm) in each loader mode and prints the median
+# load time (load_ms from --bench), whole-process wall time and peak
+# RSS:
+#   decode  --no-cache, the .bc0 text is decoded every run
+#   cold    empty cache directory, decoded and written to the cache
+#   warm    cached image mapped from the cache directory
+#   image   an image from --write-image, run directly
+# then runs tests/bench/hello.c0 with only its native library loaded
+# (lazy) and with every C0 library loaded (--preload-natives).
+
+VM=${C0VM:-./c0vm}
+CC0=${CC0:-cc0}
+RUNS=10
+FUNCTIONS=2000
+
+while getopts n:f: opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    f) FUNCTIONS=$OPTARG ;;
+    *) sed -n '4p' "$0" | sed 's/^# //' >&2; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ $# -gt 0 ]; then
+  BC0=$1
+else
+  awk -v n="$FUNCTIONS" 'BEGIN {
+    for (k = 0; k < n; k++) {
+      printf "int f%d(int x) {\n  int s = %d;\n", k, k
+      printf "  for (int i = 0; i < x; i++) {\n"
+      printf "    s += i * %d;\n    if (s > 1000) s -= 1000;\n  }\n", k + 1
+      printf "  return s;\n}\n\n"
+    }
+    printf "int main() {\n  return f0(10);\n}\n"
+  }' > "$WORK/startup.c0"
+  (cd "$WORK" && "$CC0" -b startup.c0) || exit 2
+  BC0=$WORK/startup.bc0
+fi
+"$VM" --no-cache --write-image="$WORK/startup.img" "$BC0" || exit 2
+
+LOADS=$WORK/loads
+WALLS=$WORK/walls
+RSS=$WORK/rss
+
+median() {
+  sort -n "$1" | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }'
+}
+
+# run_mode NAME SETUP VM-ARGS...: SETUP runs before every timed run
+run_mode() {
+  name=$1
+  setup=$2
+  shift 2
+  : > "$LOADS"
+  : > "$WALLS"
+  : > "$RSS"
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    eval "$setup"
+    start=$(date +%s%N)
+    "$VM" --bench=1 --warmup=0 --stats=- "$@" 2> "$WORK/err" > /dev/null ||
+      exit 2
+    end=$(date +%s%N)
+    sed -n 's/.*load_ms=\([0-9.]*\).*/\1/p' "$WORK/err" >> "$LOADS"
+    sed -n 's/.*maxrss_kb=\([0-9]*\).*/\1/p' "$WORK/err" >> "$RSS"
+    echo $(( (end - start) / 1000 )) >> "$WALLS"
+    i=$((i + 1))
+  done
+  awk -v n="$name" -v l="$(median "$LOADS")" -v w="$(median "$WALLS")" \
+      -v r="$(median "$RSS")" '
+    BEGIN { printf "%-8s %12.3f %12.1f %12d\n", n, l, w / 1000, r }'
+}
+
+echo "program: $BC0 ($(wc -c < "$BC0") bytes, image $(wc -c < "$WORK/startup.img") bytes)"
+printf '%-8s %12s %12s %12s\n' mode load_ms wall_ms rss_kb
+run_mode decode ":" --no-cache "$BC0"
+run_mode cold 'rm -rf "$WORK/cache"' --cache-dir="$WORK/cache" "$BC0"
+run_mode warm ":" --cache-dir="$WORK/cache" "$BC0"
+run_mode image ":" --no-cache "$WORK/startup.img"
+
+cp "$(dirname "$0")/hello.c0" "$WORK/hello.c0"
+(cd "$WORK" && "$CC0" -b hello.c0) || exit 2
+run_mode lazy ":" --no-cache "$WORK/hello.bc0"
+run_mode preload ":" --no-cache --preload-natives "$WORK/hello.bc0"